@@ -0,0 +1,117 @@
+#include <efi.h>
+#include <efilib.h>
+
+/* Microbenchmark for CopyMem/SetMem (and so memcpy/memset), printing
+ * bytes per TSC cycle for each size class: aligned copy, copy with a
+ * misaligned destination, overlapping move and set. */
+
+#define BUF_SIZE	(1024 * 1024 + 64)
+#define BYTES_PER_TEST	(32 * 1024 * 1024)
+
+static const UINTN sizes[] = { 16, 64, 256, 1024, 4096, 65536, 1024 * 1024 };
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline UINT64 cycles(void)
+{
+	UINT32 lo, hi;
+	__asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((UINT64)hi << 32) | lo;
+}
+#else
+static inline UINT64 cycles(void)
+{
+	return 0;
+}
+#endif
+
+enum { COPY, COPY_MISALIGNED, MOVE, SET, NTESTS };
+
+static const CHAR16 *names[NTESTS] = { L"copy", L"copy+1", L"move", L"set" };
+
+static UINT64 run(int test, UINT8 *src, UINT8 *dst, UINTN size)
+{
+	UINTN iters = BYTES_PER_TEST / size;
+	UINT64 start, end;
+	UINTN i;
+
+	start = cycles();
+
+	for (i = 0; i < iters; i++) {
+		switch (test) {
+		case COPY:
+			CopyMem(dst, src, size);
+			break;
+		case COPY_MISALIGNED:
+			CopyMem(dst + 1, src, size);
+			break;
+		case MOVE:
+			/* Overlapping, takes the backwards path */
+			CopyMem(src + 8, src, size);
+			break;
+		case SET:
+			SetMem(dst, size, (UINT8)i);
+			break;
+		}
+	}
+
+	end = cycles();
+	return end - start;
+}
+
+/* Prints bytes/cycle with two decimals */
+static void print_rate(UINTN bytes, UINT64 ticks)
+{
+	UINT64 rate = ticks ? (UINT64)bytes * 100 / ticks : 0;
+
+	Print(L"  %4ld.%02ld", rate / 100, rate % 100);
+}
+
+EFI_STATUS
+efi_main (EFI_HANDLE image, EFI_SYSTEM_TABLE *systab)
+{
+	EFI_STATUS efi_status;
+	UINT8 *src, *dst;
+	UINTN i;
+	int test;
+
+	InitializeLib(image, systab);
+
+	if (cycles() == 0) {
+		Print(L"membench: no cycle counter on this architecture\n");
+		return EFI_UNSUPPORTED;
+	}
+
+	efi_status = uefi_call_wrapper(BS->AllocatePool, 3, EfiLoaderData, BUF_SIZE, (void **)&src);
+	if (EFI_ERROR(efi_status))
+		return efi_status;
+
+	efi_status = uefi_call_wrapper(BS->AllocatePool, 3, EfiLoaderData, BUF_SIZE, (void **)&dst);
+	if (EFI_ERROR(efi_status)) {
+		FreePool(src);
+		return efi_status;
+	}
+
+	for (i = 0; i < BUF_SIZE; i++)
+		src[i] = (UINT8)i;
+
+	Print(L"bytes/cycle     size");
+	for (test = 0; test < NTESTS; test++)
+		Print(L"  %7s", names[test]);
+	Print(L"\n");
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		UINTN iters = BYTES_PER_TEST / sizes[i];
+
+		Print(L"            %8d", sizes[i]);
+		for (test = 0; test < NTESTS; test++) {
+			/* Warm the caches and the branch predictors first */
+			run(test, src, dst, sizes[i]);
+			print_rate(iters * sizes[i], run(test, src, dst, sizes[i]));
+		}
+		Print(L"\n");
+	}
+
+	FreePool(dst);
+	FreePool(src);
+	return EFI_SUCCESS;
+}
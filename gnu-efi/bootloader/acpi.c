@@ -0,0 +1,286 @@
+/*
+ *  MIT License
+ *
+ *  Copyright (c) 2022 FacelessSociety, Ian Marco Moffett
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+
+#include <efi.h>
+#include <efilib.h>
+#include <common/acpi.h>
+#include <common/log.h>
+
+#define RSDP_V1_LENGTH 20
+#define SDT_HEADER_LENGTH 36
+
+// Longer tables are taken as garbage rather than checksummed.
+#define ACPI_MAX_TABLE_LENGTH (16 * 1024 * 1024)
+
+// FADT fields, see ACPI 6.5 section 5.2.9.
+#define FADT_FIRMWARE_CTRL 36
+#define FADT_DSDT 40
+#define FADT_X_FIRMWARE_CTRL 132
+#define FADT_X_DSDT 140
+
+extern struct FacelessServices fs;
+
+
+struct __attribute__((packed)) Rsdp {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+    uint32_t length;                                // Revision 2+ from here on.
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+};
+
+
+struct __attribute__((packed)) SdtHeader {
+    uint32_t signature;
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+};
+
+
+static BOOLEAN checksum_ok(const void* data, UINTN length) {
+    const uint8_t* p = data;
+    uint8_t sum = 0;
+
+    for (UINTN i = 0; i < length; ++i) {
+        sum += p[i];
+    }
+
+    return sum == 0;
+}
+
+
+// Returns the table at @address if its header and checksum hold up.
+static struct SdtHeader* valid_table(uint64_t address, BOOLEAN has_checksum) {
+    struct SdtHeader* header = (struct SdtHeader*)address;
+
+    if (address == 0) {
+        return NULL;
+    }
+
+    if (!has_checksum) {
+        return header;
+    }
+
+    if (header->length < SDT_HEADER_LENGTH || header->length > ACPI_MAX_TABLE_LENGTH ||
+            !checksum_ok(header, header->length)) {
+        return NULL;
+    }
+
+    return header;
+}
+
+
+static inline uint64_t read_u64(const uint8_t* p) {
+    uint64_t v;
+    CopyMem(&v, p, sizeof(v));
+    return v;
+}
+
+
+static inline uint32_t read_u32(const uint8_t* p) {
+    uint32_t v;
+    CopyMem(&v, p, sizeof(v));
+    return v;
+}
+
+
+/*
+ *  Inserts a table keeping the directory sorted by signature.
+ *  Equal signatures stay in the order they were added.
+ *
+ */
+
+static void add_table(struct BootAcpiTable* tables, uint32_t* ntables, struct SdtHeader* header) {
+    uint32_t i = *ntables;
+
+    for (; i > 0 && tables[i - 1].signature > header->signature; --i) {
+        tables[i] = tables[i - 1];
+    }
+
+    tables[i].signature = header->signature;
+    tables[i].length = header->length;
+    tables[i].address = (uint64_t)header;
+    ++*ntables;
+}
+
+
+/*
+ *  Walks RSDP -> XSDT (or RSDT) -> every table once, checking every
+ *  checksum, and hands the result to the kernel in fs.acpi. Needs
+ *  firmware_index_tables() to have run.
+ *
+ */
+
+void acpi_index_tables(void) {
+    struct BootAcpiDirectory* dir = &fs.acpi;
+    struct Rsdp* rsdp = fs.rsdp;
+
+    dir->tables = NULL;
+    dir->ntables = dir->rejected = 0;
+    dir->revision = 0;
+    dir->xsdt = 0;
+
+    if (rsdp == NULL || !checksum_ok(rsdp, RSDP_V1_LENGTH)) {
+        log_error(L"No valid RSDP, ACPI tables are not indexed.\n");
+        return;
+    }
+
+    // The XSDT if there is one, its entries are 64-bit.
+    BOOLEAN xsdt = rsdp->revision >= 2 && rsdp->length >= sizeof(struct Rsdp) &&
+        checksum_ok(rsdp, rsdp->length) && rsdp->xsdt_address != 0;
+    struct SdtHeader* root = xsdt ? valid_table(rsdp->xsdt_address, TRUE) : NULL;
+
+    // A broken XSDT leaves the RSDT, which every RSDP has.
+    if (root == NULL) {
+        if (xsdt) {
+            log_error(L"The XSDT has a bad checksum, falling back to the RSDT.\n");
+            xsdt = FALSE;
+        }
+
+        root = valid_table(rsdp->rsdt_address, TRUE);
+    }
+
+    if (root == NULL) {
+        log_error(L"The RSDT has a bad checksum, ACPI tables are not indexed.\n");
+        return;
+    }
+
+    UINTN entry_size = xsdt ? 8 : 4;
+
+    const uint8_t* entries = (const uint8_t*)root + SDT_HEADER_LENGTH;
+    UINTN nentries = (root->length - SDT_HEADER_LENGTH) / entry_size;
+
+    // Room for the DSDT and FACS as well.
+    struct BootAcpiTable* tables;
+
+    if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, (nentries + 2) * sizeof(struct BootAcpiTable), (void**)&tables))) {
+        log_error(L"Failed to allocate the ACPI table directory.\n");
+        return;
+    }
+
+    uint32_t ntables = 0;
+    uint32_t rejected = 0;
+    struct SdtHeader* fadt = NULL;
+
+    for (UINTN i = 0; i < nentries; ++i) {
+        const uint8_t* entry = entries + i * entry_size;
+        uint64_t address = xsdt ? read_u64(entry) : read_u32(entry);
+        struct SdtHeader* header = valid_table(address, TRUE);
+
+        if (header == NULL) {
+            rejected += address != 0;
+            continue;
+        }
+
+        if (header->signature == ACPI_SIGNATURE('F', 'A', 'C', 'P') && fadt == NULL) {
+            fadt = header;
+        }
+
+        add_table(tables, &ntables, header);
+    }
+
+    // The DSDT and FACS are only reachable through the FADT.
+    if (fadt != NULL) {
+        const uint8_t* f = (const uint8_t*)fadt;
+        uint64_t dsdt = fadt->length >= FADT_X_DSDT + 8 ? read_u64(f + FADT_X_DSDT) : 0;
+        uint64_t facs = fadt->length >= FADT_X_FIRMWARE_CTRL + 8 ? read_u64(f + FADT_X_FIRMWARE_CTRL) : 0;
+
+        // The 32-bit fields are past the header too, ACPI 1.0 FADTs can be short.
+        if (fadt->length >= FADT_DSDT + 4) {
+            dsdt = dsdt ? dsdt : read_u32(f + FADT_DSDT);
+            facs = facs ? facs : read_u32(f + FADT_FIRMWARE_CTRL);
+        }
+
+        struct SdtHeader* header = valid_table(dsdt, TRUE);
+
+        if (header != NULL) {
+            add_table(tables, &ntables, header);
+        } else {
+            rejected += dsdt != 0;
+        }
+
+        // The FACS has a signature and length but no checksum.
+        header = valid_table(facs, FALSE);
+
+        if (header != NULL && header->signature == ACPI_SIGNATURE('F', 'A', 'C', 'S')) {
+            add_table(tables, &ntables, header);
+        }
+    }
+
+    dir->tables = tables;
+    dir->ntables = ntables;
+    dir->rejected = rejected;
+    dir->revision = rsdp->revision;
+    dir->xsdt = xsdt;
+
+    if (rejected != 0) {
+        log_error(L"Skipped %d ACPI tables with bad checksums.\n", rejected);
+    }
+
+    log_debug(L"Indexed %d ACPI tables through the %a.\n", ntables, xsdt ? "XSDT" : "RSDT");
+}
+
+
+/*
+ *  Finds a table in fs.acpi by binary search.
+ *
+ *  @signature: ACPI_SIGNATURE() of the table.
+ *  @instance: Which of the tables with that signature, from 0.
+ *
+ *  Returns NULL if there is no such table.
+ *
+ */
+
+const struct BootAcpiTable* acpi_find(uint32_t signature, uint32_t instance) {
+    const struct BootAcpiTable* tables = fs.acpi.tables;
+    uint32_t lo = 0, hi = fs.acpi.ntables;
+
+    // First table with a signature not below @signature.
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (tables[mid].signature < signature) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (instance >= fs.acpi.ntables - lo || tables[lo + instance].signature != signature) {
+        return NULL;
+    }
+
+    return &tables[lo + instance];
+}
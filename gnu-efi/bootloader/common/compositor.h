@@ -0,0 +1,46 @@
+/*
+ *  MIT License
+ *
+ *  Copyright (c) 2022 FacelessSociety, Ian Marco Moffett
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+
+#ifndef COMPOSITOR_H
+#define COMPOSITOR_H
+
+#include <efi.h>
+#include <stdint.h>
+
+extern uint32_t* compositor_backbuffer;
+
+EFI_STATUS compositor_init(void);
+void framebuf_damage(unsigned int x, unsigned int y, unsigned int width, unsigned int height);
+void framebuf_flush(void);
+
+
+// Records damage for draws that went into the backbuffer.
+static inline void compositor_track(uint32_t* target, unsigned int x, unsigned int y, unsigned int width, unsigned int height) {
+    if (target == compositor_backbuffer) {
+        framebuf_damage(x, y, width, height);
+    }
+}
+
+#endif
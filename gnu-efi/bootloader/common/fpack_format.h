@@ -0,0 +1,92 @@
+/*
+ *  MIT License
+ *
+ *  Copyright (c) 2022 FacelessSociety, Ian Marco Moffett
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+
+/*
+ *  FacelessPack (.fpk) on-disk format.
+ *
+ *  Shared by the loader and the host side packer, so this must
+ *  only depend on <stdint.h>.
+ *
+ *  Layout:
+ *      struct FPackHeader
+ *      struct FPackEntry[nentries]
+ *      entry data, each entry starting at a multiple of its alignment.
+ *
+ *  All offsets are from the start of the pack. Checksums are CRC32
+ *  (the same polynomial as CalculateCrc()) of the stored bytes.
+ *
+ *  Entries flagged FPACK_FLAG_LZ4 are stored as one LZ4 block that
+ *  decompresses to raw_size bytes.
+ *
+ */
+
+#ifndef FPACK_FORMAT_H
+#define FPACK_FORMAT_H
+
+#include <stdint.h>
+
+#define FPACK_MAGIC 0x4B435046                  // 'FPCK'.
+#define FPACK_VERSION 2
+#define FPACK_NAME_LEN 32
+#define FPACK_MAX_ENTRIES 64
+
+#define FPACK_FLAG_LZ4 (1 << 0)                 // Data is an LZ4 block.
+
+
+struct __attribute__((packed)) FPackHeader {
+    uint32_t magic;                             // FPACK_MAGIC.
+    uint16_t version;                           // FPACK_VERSION.
+    uint16_t nentries;                          // Number of index entries.
+    uint32_t index_crc;                         // CRC32 of the entry index.
+    uint32_t reserved;
+    uint64_t pack_size;                         // Size of the whole pack in bytes.
+};
+
+
+struct __attribute__((packed)) FPackEntry {
+    char name[FPACK_NAME_LEN];                  // NUL padded file name.
+    uint32_t name_hash;                         // fpack_hash() of name.
+    uint32_t checksum;                          // CRC32 of the entry data.
+    uint64_t offset;                            // Offset of the entry data.
+    uint64_t size;                              // Size of the stored entry data.
+    uint64_t raw_size;                          // Size once decompressed.
+    uint32_t alignment;                         // Alignment of offset.
+    uint32_t flags;                             // FPACK_FLAG_*.
+};
+
+
+// FNV-1a, used for the index name hashes.
+static inline uint32_t fpack_hash(const char* name) {
+    uint32_t hash = 0x811C9DC5;
+
+    while (*name) {
+        hash ^= (uint8_t)*name++;
+        hash *= 0x01000193;
+    }
+
+    return hash;
+}
+
+#endif
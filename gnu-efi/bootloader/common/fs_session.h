@@ -0,0 +1,80 @@
+/*
+ *  MIT License
+ *
+ *  Copyright (c) 2022 FacelessSociety, Ian Marco Moffett
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+
+#ifndef FS_SESSION_H
+#define FS_SESSION_H
+
+#include <efi.h>
+#include <stdint.h>
+
+// Firmware calls needed to reach the root directory without a session
+// (HandleProtocol(LoadedImage), HandleProtocol(SimpleFileSystem), OpenVolume).
+#define FS_SESSION_ROOT_CALLS 3
+
+// Whole file reads that can be in flight at once.
+#define FS_SESSION_MAX_READS 8
+
+
+// A whole file read, possibly overlapped through ReadEx().
+struct FsRead {
+    CHAR16* path;
+    EFI_FILE* file;                     // NULL once the read is finished.
+    EFI_FILE_IO_TOKEN token;
+    EFI_PHYSICAL_ADDRESS addr;          // Page aligned destination.
+    UINTN size;
+    uint64_t start;                     // TSC when the read was issued.
+    volatile uint64_t end;              // TSC when ReadEx() signalled, 0 until then.
+    BOOLEAN async;                      // ReadEx() was issued.
+};
+
+
+/*
+ *  Boot volume session.
+ *
+ *  The root directory is opened once and every file lookup
+ *  goes through it.
+ *
+ */
+
+struct FsSession {
+    EFI_FILE* root;
+    UINTN files_opened;
+    UINTN files_closed;
+    UINTN calls_saved;                  // Firmware calls avoided by reusing root.
+    UINTN async_reads;                  // Reads issued through ReadEx().
+    struct FsRead reads[FS_SESSION_MAX_READS];
+    UINTN nreads;
+};
+
+extern struct FsSession fsession;
+
+EFI_STATUS fs_session_open(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE* st);
+EFI_STATUS fs_session_open_file(CHAR16* path, EFI_FILE** file);
+void fs_session_close_file(EFI_FILE* file);
+EFI_STATUS fs_session_prefetch(CHAR16* path);
+EFI_STATUS fs_session_fetch(CHAR16* path, void** buf, UINTN* size);
+void fs_session_close(void);
+
+#endif
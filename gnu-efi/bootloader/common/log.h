@@ -0,0 +1,57 @@
+/*
+ *  MIT License
+ *
+ *  Copyright (c) 2022 FacelessSociety, Ian Marco Moffett
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <efi.h>
+#include <config.h>
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_DEBUG 2
+
+
+/*
+ *  Messages above LOG_LEVEL are compiled out, messages above
+ *  LOG_CONSOLE_LEVEL only go to the boot log ring.
+ *
+ */
+
+#define LOG(level, ...) \
+    do { \
+        if ((level) <= LOG_LEVEL) { \
+            log_write((level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define log_error(...) LOG(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_info(...) LOG(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) LOG(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+void log_init(void);
+void log_write(UINTN level, CONST CHAR16* fmt, ...);
+
+#endif
@@ -0,0 +1,57 @@
+/*
+ *  MIT License
+ *
+ *  Copyright (c) 2022 FacelessSociety, Ian Marco Moffett
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+
+#ifndef MP_H
+#define MP_H
+
+#include <efi.h>
+#include <stdint.h>
+
+
+/*
+ *  A unit of CPU-bound boot work.
+ *
+ *  Jobs may run on an application processor, so they must not
+ *  call boot services or log.
+ *
+ */
+
+struct MpJob {
+    void(*fn)(void* arg);
+    void* arg;
+};
+
+
+// Result of an mp_run().
+struct MpRun {
+    uint64_t work;                      // TSC ticks spent in jobs, summed over CPUs.
+    UINTN ncpus;                        // CPUs that took part.
+};
+
+void mp_init(void);
+UINTN mp_cpu_count(void);
+struct MpRun mp_run(struct MpJob* jobs, UINTN njobs);
+
+#endif
@@ -74,9 +74,449 @@ struct __attribute__((packed)) PSFontHeader {
 };
 
 
+struct __attribute__((packed)) PSF2Header {
+    uint32_t magic;                                 // 0x864AB572.
+    uint32_t version;                               // 0.
+    uint32_t header_size;                           // Offset of the glyphs.
+    uint32_t flags;                                 // Bit 0: Unicode table follows the glyphs.
+    uint32_t nglyphs;
+    uint32_t bytes_per_glyph;
+    uint32_t height;
+    uint32_t width;
+};
+
+
+// Code points covered by the Unicode lookup, U+0000 to U+10FFFF.
+#define FONT_UNICODE_PAGES 0x1100
+
+
+/*
+ *  A loaded PSF1 or PSF2 font.
+ *
+ *  Glyph g is height rows of bytes_per_row bytes at glyph_buf +
+ *  g * bytes_per_glyph, most significant bit leftmost.
+ *
+ *  Code point c draws glyph
+ *  unicode_blocks[unicode_pages[c >> 8] * 256 + (c & 0xFF)].
+ *  Block 0 maps everything to the replacement glyph.
+ *
+ */
+
 struct __attribute__((packed)) PSFont {
-    struct PSFontHeader* header;
+    struct PSFontHeader* header;                    // Start of the font file, see version.
     void* glyph_buf;
+    uint32_t version;                               // 1 or 2.
+    uint32_t nglyphs;
+    uint32_t width;
+    uint32_t height;
+    uint32_t bytes_per_row;
+    uint32_t bytes_per_glyph;
+    uint16_t* unicode_pages;                        // FONT_UNICODE_PAGES block numbers.
+    uint16_t* unicode_blocks;                       // 256 glyph indices per block.
+};
+
+
+#define BOOT_TIMING_MAX_STAGES 32
+#define BOOT_STAGE_NAME_LEN 24
+
+
+// A single TSC-stamped loader stage.
+struct __attribute__((packed)) BootStage {
+    char name[BOOT_STAGE_NAME_LEN];                 // NUL terminated stage name.
+    uint64_t start;                                 // TSC at stage start.
+    uint64_t end;                                   // TSC at stage end.
+    uint64_t work;                                  // TSC ticks of work summed over CPUs, 0 if serial.
+    uint32_t ncpus;                                 // CPUs that shared the work.
+};
+
+
+// Per-stage boot timing table.
+struct __attribute__((packed)) BootTiming {
+    uint64_t tsc_freq;                              // TSC ticks per second.
+    uint64_t tsc_entry;                             // TSC at efi_main() entry.
+    uint64_t tsc_handoff;                           // TSC right before the kernel is called.
+    uint32_t nstages;                               // Number of valid entries in stages.
+    struct BootStage stages[BOOT_TIMING_MAX_STAGES];
+};
+
+
+/*
+ *  In-memory boot log ring.
+ *
+ *  head counts every byte ever written, so the log starts at
+ *  buffer[0] while head <= size, and at buffer[head % size]
+ *  once it has wrapped.
+ *
+ */
+
+struct __attribute__((packed)) BootLog {
+    char* buffer;                                   // ASCII, \n separated.
+    uint64_t size;                                  // Capacity of buffer.
+    uint64_t head;                                  // Total bytes written.
+};
+
+
+/*
+ *  One entry of the normalized memory map.
+ *
+ *  Fixed 32 byte stride, two entries per cache line. type
+ *  uses the EFI memory type numbering (mem_type_t).
+ *
+ */
+
+struct __attribute__((packed)) BootMemRegion {
+    uint64_t base;                                  // Physical base, page aligned.
+    uint64_t npages;                                // Length in 4 KiB pages.
+    uint64_t attr;                                  // EFI_MEMORY_* attribute bits.
+    uint32_t type;                                  // Memory type.
+    uint32_t reserved;
+};
+
+
+/*
+ *  Final memory map, taken right before ExitBootServices().
+ *
+ *  Regions are sorted by base and touching regions with the same
+ *  type and attributes are merged. Usable means conventional
+ *  memory, reclaimable is boot services code and data, which is
+ *  free once the kernel is off the firmware stack.
+ *
+ */
+
+struct __attribute__((packed)) BootMemoryMap {
+    struct BootMemRegion* regions;
+    uint64_t nregions;
+    uint64_t usable_bytes;                          // Conventional memory in bytes.
+    uint64_t reclaimable_bytes;                     // Boot services memory in bytes.
+    uint64_t largest_free_base;                     // Base of the largest conventional region.
+    uint64_t largest_free_pages;                    // Its length in pages.
+    uint64_t highest_addr;                          // End of the highest region.
+};
+
+
+/*
+ *  Page tables the kernel is entered on (CR3 = pml4).
+ *
+ *  Physical memory is identity mapped and mapped again at
+ *  direct_map_base, both with large pages. The framebuffer is
+ *  write-combining through PAT entry 7, the rest write-back.
+ *  Kernel segments linked away from their load address are
+ *  mapped there too.
+ *  pml4 is 0 if the kernel runs on the firmware's tables.
+ *
+ */
+
+struct __attribute__((packed)) BootPaging {
+    uint64_t pml4;                                  // Physical address of the PML4.
+    uint64_t direct_map_base;                       // Virtual address of physical 0.
+    uint64_t direct_map_size;                       // Bytes covered by both maps.
+    uint64_t large_page_size;                       // 1 GiB or 2 MiB.
+    uint64_t tables_base;                           // Physical block holding every table.
+    uint64_t tables_used;                           // Tables (4 KiB pages) used in the block.
+};
+
+
+/*
+ *  Physical frame bitmap built from the final memory map.
+ *
+ *  One bit per 4 KiB frame starting at physical 0, set means
+ *  used. Only conventional memory starts out free; loader,
+ *  kernel, boot services and framebuffer frames are used.
+ *
+ */
+
+struct __attribute__((packed)) BootFrameBitmap {
+    uint64_t* bits;                                 // NULL if the loader built none.
+    uint64_t nframes;                               // Frames covered by bits.
+    uint64_t free_frames;                           // Number of clear bits.
+    uint64_t first_free;                            // Lowest free frame, nframes if none.
+};
+
+
+/*
+ *  Firmware configuration tables found by the loader, NULL for
+ *  any the firmware doesn't publish. Addresses are physical.
+ *
+ */
+
+struct __attribute__((packed)) BootFirmwareTables {
+    void* acpi10_rsdp;                              // ACPI 1.0 RSDP, RSDT only.
+    void* acpi20_rsdp;                              // ACPI 2.0+ RSDP, has the XSDT.
+    void* smbios;                                   // SMBIOS 2 entry point ("_SM_").
+    void* smbios3;                                  // SMBIOS 3 entry point ("_SM3_").
+    void* memory_attributes;                        // EFI memory attributes table.
+    void* rng_seed;                                 // Linux EFI random seed table.
+    uint64_t nentries;                              // Entries in the firmware's table.
+};
+
+
+// ACPI table signature as a 32-bit key, ACPI_SIGNATURE('A', 'P', 'I', 'C').
+#define ACPI_SIGNATURE(a, b, c, d) \
+    ((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+
+// One ACPI table with a valid checksum.
+struct __attribute__((packed)) BootAcpiTable {
+    uint32_t signature;                             // ACPI_SIGNATURE() of the header.
+    uint32_t length;                                // Length from the header, in bytes.
+    uint64_t address;                               // Physical address of the header.
+};
+
+
+/*
+ *  Every table reachable from the RSDP, read once by the loader.
+ *
+ *  Sorted by signature, tables sharing one (SSDTs) keep XSDT
+ *  order. The DSDT and FACS named by the FADT are included.
+ *
+ */
+
+struct __attribute__((packed)) BootAcpiDirectory {
+    struct BootAcpiTable* tables;                   // NULL if there's no valid RSDP.
+    uint32_t ntables;
+    uint32_t rejected;                              // Tables skipped for bad checksums.
+    uint8_t revision;                               // RSDP revision.
+    uint8_t xsdt;                                   // 1 if indexed through the XSDT, 0 through the RSDT.
+};
+
+
+#define SMBIOS_TYPES 256
+
+
+// One SMBIOS structure, see BootSmbiosIndex.
+struct __attribute__((packed)) BootSmbiosStructure {
+    uint64_t address;                               // Physical address of the formatted area.
+    uint16_t handle;
+    uint8_t type;
+    uint8_t length;                                 // Bytes in the formatted area.
+    uint32_t first_string;                          // Index of string 1 in string_offsets.
+    uint16_t nstrings;
+    uint16_t reserved;
+};
+
+
+/*
+ *  Every SMBIOS structure, walked once by the loader.
+ *
+ *  Structures of type t are structures[type_start[t]] up to
+ *  structures[type_start[t + 1]], in table order. String n (from 1)
+ *  of structure s is at s.address + string_offsets[s.first_string + n - 1].
+ *
+ */
+
+struct __attribute__((packed)) BootSmbiosIndex {
+    struct BootSmbiosStructure* structures;         // NULL if there's no valid SMBIOS table.
+    uint16_t* string_offsets;                       // Offsets from each structure's address.
+    uint32_t nstructures;
+    uint32_t nstrings;
+    uint32_t type_start[SMBIOS_TYPES + 1];
+    uint64_t table_address;
+    uint32_t table_length;
+    uint8_t major;                                  // SMBIOS version.
+    uint8_t minor;
+};
+
+
+#define PCI_MAX_BARS 6
+
+#define PCI_BAR_IO 0x01                             // I/O ports rather than memory.
+#define PCI_BAR_PREFETCHABLE 0x02
+#define PCI_BAR_64BIT 0x04                          // Also uses the next BAR register.
+
+
+// A BAR as the firmware assigned it.
+struct __attribute__((packed)) BootPciBar {
+    uint64_t base;
+    uint64_t length;                                // 0 if the BAR is unused.
+    uint32_t flags;                                 // PCI_BAR_*.
+};
+
+
+// One PCI function the firmware enumerated.
+struct __attribute__((packed)) BootPciDevice {
+    uint16_t segment;
+    uint8_t bus;
+    uint8_t device;
+    uint8_t function;
+    uint8_t header_type;                            // Without the multi-function bit.
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint16_t subsystem_vendor_id;                   // 0 unless header_type is 0.
+    uint16_t subsystem_id;
+    uint8_t class_code;
+    uint8_t subclass;
+    uint8_t prog_if;
+    uint8_t revision;
+    uint8_t interrupt_line;
+    uint8_t interrupt_pin;
+    struct BootPciBar bars[PCI_MAX_BARS];
+};
+
+
+// Every PCI function, sorted by segment, bus, device and function.
+struct __attribute__((packed)) BootPciInventory {
+    struct BootPciDevice* devices;                  // NULL if the firmware has no PCI I/O.
+    uint32_t ndevices;
+};
+
+
+// Feature bits in BootCpuInfo, what the CPU supports. Extended
+// state (AVX and up) still has to be enabled in XCR0 by the kernel.
+#define BOOT_CPU_SSE (1ULL << 0)
+#define BOOT_CPU_SSE2 (1ULL << 1)
+#define BOOT_CPU_SSE3 (1ULL << 2)
+#define BOOT_CPU_SSSE3 (1ULL << 3)
+#define BOOT_CPU_SSE41 (1ULL << 4)
+#define BOOT_CPU_SSE42 (1ULL << 5)
+#define BOOT_CPU_AVX (1ULL << 6)
+#define BOOT_CPU_AVX2 (1ULL << 7)
+#define BOOT_CPU_AVX512F (1ULL << 8)
+#define BOOT_CPU_AVX512DQ (1ULL << 9)
+#define BOOT_CPU_AVX512BW (1ULL << 10)
+#define BOOT_CPU_AVX512VL (1ULL << 11)
+#define BOOT_CPU_FMA (1ULL << 12)
+#define BOOT_CPU_ERMS (1ULL << 13)                  // Fast rep movsb/stosb.
+#define BOOT_CPU_FSRM (1ULL << 14)                  // Fast short rep movsb.
+#define BOOT_CPU_XSAVE (1ULL << 15)
+#define BOOT_CPU_PAGE1GB (1ULL << 16)
+#define BOOT_CPU_INVARIANT_TSC (1ULL << 17)
+#define BOOT_CPU_X2APIC (1ULL << 18)
+#define BOOT_CPU_TSC_DEADLINE (1ULL << 19)
+#define BOOT_CPU_NX (1ULL << 20)
+#define BOOT_CPU_PCID (1ULL << 21)
+#define BOOT_CPU_INVPCID (1ULL << 22)
+#define BOOT_CPU_SMEP (1ULL << 23)
+#define BOOT_CPU_SMAP (1ULL << 24)
+#define BOOT_CPU_LA57 (1ULL << 25)
+#define BOOT_CPU_POPCNT (1ULL << 26)
+#define BOOT_CPU_BMI1 (1ULL << 27)
+#define BOOT_CPU_BMI2 (1ULL << 28)
+#define BOOT_CPU_PCLMUL (1ULL << 29)
+#define BOOT_CPU_AES (1ULL << 30)
+#define BOOT_CPU_RDRAND (1ULL << 31)
+#define BOOT_CPU_RDSEED (1ULL << 32)
+
+#define BOOT_CPU_MAX_CACHES 8
+#define BOOT_CPU_MAX_TLBS 16
+
+#define BOOT_CACHE_DATA 1
+#define BOOT_CACHE_INSTRUCTION 2
+#define BOOT_CACHE_UNIFIED 3
+
+#define BOOT_TLB_4K 0x01                            // Page sizes a TLB holds.
+#define BOOT_TLB_2M 0x02
+#define BOOT_TLB_4M 0x04
+#define BOOT_TLB_1G 0x08
+
+
+struct __attribute__((packed)) BootCpuCache {
+    uint8_t level;
+    uint8_t type;                                   // BOOT_CACHE_*.
+    uint16_t line_size;
+    uint32_t ways;
+    uint32_t sets;
+    uint32_t size;                                  // Bytes.
+    uint32_t shared_by;                             // Logical processors sharing it, at most.
+};
+
+
+struct __attribute__((packed)) BootCpuTlb {
+    uint8_t level;
+    uint8_t type;                                   // BOOT_CACHE_*.
+    uint8_t page_sizes;                             // BOOT_TLB_*.
+    uint8_t fully_associative;
+    uint32_t ways;
+    uint32_t entries;
+};
+
+
+// One logical processor, as MP Services reports it.
+struct __attribute__((packed)) BootCpu {
+    uint32_t apic_id;
+    uint32_t package;
+    uint32_t core;
+    uint32_t thread;
+    uint32_t flags;                                 // Bit 0: BSP, bit 1: enabled, bit 2: healthy.
+};
+
+
+// CPUID snapshot taken on the BSP, plus the processor topology.
+struct __attribute__((packed)) BootCpuInfo {
+    char vendor[16];                                // NUL terminated, "GenuineIntel".
+    char brand[49];                                 // NUL terminated brand string.
+    uint32_t max_leaf;
+    uint32_t max_ext_leaf;
+    uint32_t family;                                // Display family and model.
+    uint32_t model;
+    uint32_t stepping;
+    uint64_t features;                              // BOOT_CPU_*.
+    uint64_t xcr0_supported;                        // XCR0 bits the CPU supports.
+    uint32_t xsave_size;                            // XSAVE area for XCR0 as it is now.
+    uint32_t xsave_max_size;                        // XSAVE area for every supported feature.
+    uint8_t phys_addr_bits;
+    uint8_t virt_addr_bits;
+    uint8_t ncaches;
+    uint8_t ntlbs;
+    struct BootCpuCache caches[BOOT_CPU_MAX_CACHES];
+    struct BootCpuTlb tlbs[BOOT_CPU_MAX_TLBS];
+    uint32_t bsp_apic_id;
+    uint32_t nlogical;                              // Logical processors.
+    uint32_t nenabled;
+    struct BootCpu* cpus;                           // nlogical entries, NULL without MP Services.
+};
+
+
+// Background colour for text drawn without one.
+#define FRAMEBUF_TRANSPARENT 0xFFFFFFFF
+
+
+// One character cell of the text console.
+struct __attribute__((packed)) ConsoleCell {
+    char ch;                                    // Latin-1 code point, drawn via font_lookup().
+    uint8_t attr;                               // Foreground palette index low, background high.
+};
+
+
+/*
+ *  Text console over the whole framebuffer, see console_write.
+ *
+ *  cells is what the screen should show, row major. Change attr
+ *  or palette freely, they apply to text written afterwards.
+ *
+ */
+
+struct __attribute__((packed)) BootConsole {
+    struct ConsoleCell* cells;                  // cols * rows, NULL if there's no console.
+    uint32_t cols;
+    uint32_t rows;
+    uint32_t cursor_x;                          // Cell the next character goes in.
+    uint32_t cursor_y;
+    uint8_t attr;                               // Attribute of new text.
+    uint32_t palette[16];                       // Framebuffer pixel values.
+};
+
+
+/*
+ *  A BMP converted to the framebuffer's pixel format, top row first.
+ *  Each row is stride pixels apart, stride equals the framebuffer's
+ *  ppsl whenever the image is no wider than the screen.
+ *
+ */
+
+struct __attribute__((packed)) BootSurface {
+    uint32_t* pixels;                           // NULL if the BMP couldn't be converted.
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;                            // Pixels per row.
+};
+
+
+// Clip rectangle in pixels for the framebuffer text services.
+struct FramebufClip {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
 };
 
 
@@ -97,7 +537,9 @@ struct FacelessServices {
         unsigned int width;
         unsigned int height;
         unsigned int ppsl;
-        uint32_t* backbuffer;
+        uint32_t* backbuffer;                       // Same layout as base_addr, see flush. NULL if none.
+        void(*flush)(void);                         // Copies damaged backbuffer areas to base_addr. NULL if no backbuffer.
+        void(*damage)(unsigned int x, unsigned int y, unsigned int width, unsigned int height);
     } framebuffer;
 
     struct PSFont* psfont;
@@ -106,6 +548,29 @@ struct FacelessServices {
     uint64_t(*mmap_get_entries)(struct MemoryMap mmap);
     EFI_MEMORY_DESCRIPTOR*(*mmap_iterator_helper)(uint64_t i, struct MemoryMap mmap);
     void(*framebuf_putch)(uint32_t color, char chr, unsigned int xOff, unsigned int yOff, uint32_t* framebuffer);
+    struct BootTiming timing;
+    struct BootLog log;
+    struct BootMemoryMap memmap;
+    struct BootPaging paging;
+    struct BootFrameBitmap frames;
+    uint64_t(*framebuf_write_span)(const char* buf, uint64_t len, uint32_t fg, uint32_t bg,
+            const struct FramebufClip* clip, unsigned int* x, unsigned int* y, uint32_t* framebuffer);
+    uint64_t(*framebuf_puts)(const char* str, uint32_t fg, uint32_t bg,
+            const struct FramebufClip* clip, unsigned int* x, unsigned int* y, uint32_t* framebuffer);
+    struct BootSurface surfaces[MAX_BMP_IMPORTS];   // Same slots as bmps.
+    struct BootConsole console;
+    void(*console_write)(const char* buf, uint64_t len);
+    void(*console_clear)(void);
+    uint32_t(*font_lookup)(uint32_t codepoint);
+    void(*framebuf_putglyph)(uint32_t color, uint32_t glyph, unsigned int xOff, unsigned int yOff, uint32_t* framebuffer);
+    struct BootFirmwareTables firmware;
+    struct BootAcpiDirectory acpi;
+    const struct BootAcpiTable*(*acpi_find)(uint32_t signature, uint32_t instance);
+    struct BootSmbiosIndex smbios;
+    const struct BootSmbiosStructure*(*smbios_find)(uint8_t type, uint32_t instance);
+    const char*(*smbios_string)(const struct BootSmbiosStructure* structure, uint8_t n);
+    struct BootPciInventory pci;
+    struct BootCpuInfo cpu;
 };
 
 #endif
@@ -0,0 +1,201 @@
+/*
+ *  MIT License
+ *
+ *  Copyright (c) 2022 FacelessSociety, Ian Marco Moffett
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+
+#include <efi.h>
+#include <efilib.h>
+#include <emmintrin.h>
+#include <common/services.h>
+#include <common/compositor.h>
+#include <common/log.h>
+
+// Damaged rectangles kept apart before they get merged.
+#define DAMAGE_MAX 16
+
+extern struct FacelessServices fs;
+
+uint32_t* compositor_backbuffer = NULL;
+
+
+// Half-open pixel rectangle.
+struct Rect {
+    uint32_t x0, y0;
+    uint32_t x1, y1;
+};
+
+static struct Rect damage[DAMAGE_MAX];
+static UINTN ndamage = 0;
+
+
+/*
+ *  Allocates the backbuffer, page aligned and laid out exactly
+ *  like the framebuffer (ppsl pixels per row).
+ *
+ */
+
+EFI_STATUS compositor_init(void) {
+    EFI_PHYSICAL_ADDRESS addr;
+    EFI_STATUS s = BS->AllocatePages(AllocateAnyPages, EfiLoaderData, EFI_SIZE_TO_PAGES(fs.framebuffer.buffer_size), &addr);
+
+    if (EFI_ERROR(s)) {
+        log_error(L"Failed to allocate a %d byte backbuffer.\n", fs.framebuffer.buffer_size);
+        fs.framebuffer.backbuffer = NULL;
+        return s;
+    }
+
+    ZeroMem((void*)addr, fs.framebuffer.buffer_size);
+    fs.framebuffer.backbuffer = (uint32_t*)addr;
+    compositor_backbuffer = fs.framebuffer.backbuffer;
+    ndamage = 0;
+    return EFI_SUCCESS;
+}
+
+
+static inline uint64_t area(struct Rect* r) {
+    return (uint64_t)(r->x1 - r->x0) * (r->y1 - r->y0);
+}
+
+
+static inline struct Rect rect_union(struct Rect* a, struct Rect* b) {
+    struct Rect u = {
+        .x0 = a->x0 < b->x0 ? a->x0 : b->x0,
+        .y0 = a->y0 < b->y0 ? a->y0 : b->y0,
+        .x1 = a->x1 > b->x1 ? a->x1 : b->x1,
+        .y1 = a->y1 > b->y1 ? a->y1 : b->y1
+    };
+
+    return u;
+}
+
+
+/*
+ *  Marks part of the backbuffer as needing a flush.
+ *
+ *  A rectangle that overlaps or touches a tracked one is merged
+ *  into it. Once the list is full, it's merged into whichever one
+ *  grows the least.
+ *
+ */
+
+void framebuf_damage(unsigned int x, unsigned int y, unsigned int width, unsigned int height) {
+    if (x >= fs.framebuffer.width || y >= fs.framebuffer.height || width == 0 || height == 0) {
+        return;
+    }
+
+    struct Rect r = {
+        .x0 = x,
+        .y0 = y,
+        .x1 = width < fs.framebuffer.width - x ? x + width : fs.framebuffer.width,
+        .y1 = height < fs.framebuffer.height - y ? y + height : fs.framebuffer.height
+    };
+
+    UINTN best = 0;
+    uint64_t best_growth = ~0ULL;
+
+    for (UINTN i = 0; i < ndamage; ++i) {
+        struct Rect* d = &damage[i];
+
+        if (r.x0 <= d->x1 && d->x0 <= r.x1 && r.y0 <= d->y1 && d->y0 <= r.y1) {
+            *d = rect_union(d, &r);
+            return;
+        }
+
+        struct Rect u = rect_union(d, &r);
+        uint64_t growth = area(&u) - area(d);
+
+        if (growth < best_growth) {
+            best = i;
+            best_growth = growth;
+        }
+    }
+
+    if (ndamage < DAMAGE_MAX) {
+        damage[ndamage++] = r;
+    } else {
+        damage[best] = rect_union(&damage[best], &r);
+    }
+}
+
+
+/*
+ *  Copies one row span with non-temporal 16 byte stores, so the
+ *  framebuffer writes neither pollute the cache nor read lines.
+ *
+ */
+
+static void stream_row(uint32_t* dst, const uint32_t* src, UINTN n) {
+    for (; n > 0 && ((UINTN)dst & 15); --n) {
+        *dst++ = *src++;
+    }
+
+    for (; n >= 16; n -= 16, dst += 16, src += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)src);
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + 4));
+        __m128i c = _mm_loadu_si128((const __m128i*)(src + 8));
+        __m128i d = _mm_loadu_si128((const __m128i*)(src + 12));
+        _mm_stream_si128((__m128i*)dst, a);
+        _mm_stream_si128((__m128i*)(dst + 4), b);
+        _mm_stream_si128((__m128i*)(dst + 8), c);
+        _mm_stream_si128((__m128i*)(dst + 12), d);
+    }
+
+    for (; n >= 4; n -= 4, dst += 4, src += 4) {
+        _mm_stream_si128((__m128i*)dst, _mm_loadu_si128((const __m128i*)src));
+    }
+
+    for (; n > 0; --n) {
+        *dst++ = *src++;
+    }
+}
+
+
+/*
+ *  Copies every damaged rectangle from the backbuffer to the
+ *  framebuffer. Works after ExitBootServices(), so it doesn't use
+ *  GOP->Blt().
+ *
+ */
+
+void framebuf_flush(void) {
+    uint32_t* front = fs.framebuffer.base_addr;
+    uint32_t* back = fs.framebuffer.backbuffer;
+    uint64_t ppsl = fs.framebuffer.ppsl;
+
+    if (back == NULL) {
+        ndamage = 0;
+        return;
+    }
+
+    for (UINTN i = 0; i < ndamage; ++i) {
+        struct Rect* r = &damage[i];
+
+        for (uint32_t y = r->y0; y < r->y1; ++y) {
+            stream_row(front + y * ppsl + r->x0, back + y * ppsl + r->x0, r->x1 - r->x0);
+        }
+    }
+
+    // Streaming stores are weakly ordered.
+    _mm_sfence();
+    ndamage = 0;
+}
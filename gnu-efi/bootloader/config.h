@@ -7,12 +7,81 @@
 #define MAX_BMP_IMPORTS 1
 
 
-static CHAR16* bmp_imports[MAX_BMP_IMPORTS] = {
+// Boot asset bundle built by kernel/tools/mkfpack. When it's present
+// the font, kernel and every *.bmp in it are loaded from it.
+#define FPACK_PATH L"boot.fpk"
+
+
+// Loose BMP files, only used when there's no boot pack.
+static CHAR16* bmp_imports[MAX_BMP_IMPORTS] __attribute__((unused)) = {
     L"kess.bmp"
 };
 
 
-#define PSF1_FONT_PATH L"zap-light16.psf"
+// What greet() does before booting.
+#define BOOT_POLICY_IMMEDIATE 0             // Boot right away.
+#define BOOT_POLICY_TIMEOUT 1               // Boot after BOOT_TIMEOUT_SECONDS or on a key press.
+#define BOOT_POLICY_WAIT_KEY 2              // Wait for a key press.
+
+#define BOOT_POLICY BOOT_POLICY_WAIT_KEY
+#define BOOT_TIMEOUT_SECONDS 3
+
+
+/*
+ *  The policy can be overridden at runtime with the
+ *  FacelessBootPolicy variable under this GUID, holding a
+ *  UINT32 policy optionally followed by a UINT32 timeout
+ *  in seconds.
+ *
+ */
+
+#define BOOT_POLICY_VARIABLE L"FacelessBootPolicy"
+#define FACELESS_LOADER_VARIABLE_GUID \
+    { 0x5b1e6a3c, 0x8f2d, 0x4c77, {0x9a, 0x61, 0x2e, 0x0d, 0x4b, 0x93, 0xc7, 0x1f} }
+
+
+// Log levels (LOG_LEVEL_* in common/log.h). Anything above LOG_LEVEL
+// is compiled out, anything above LOG_CONSOLE_LEVEL only goes to the
+// boot log ring handed to the kernel.
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#define LOG_CONSOLE_LEVEL LOG_LEVEL_INFO
+#define LOG_RING_SIZE (64 * 1024)
+
+
+// PSF1 or PSF2.
+#define FONT_PATH L"zap-light16.psf"
+#define KERNEL_PATH L"kernel.elf"
+
+
+// Read kernel.elf with one Read() and load it from memory
+// instead of seeking/reading per ELF structure.
+#define KERNEL_LOAD_IN_MEMORY 1
+
+
+// Prefetch boot files with overlapped ReadEx() calls when the file
+// protocol supports them.
+#define FS_ASYNC_READS 1
+
+
+// Enter the kernel on loader-built page tables with a direct map
+// of physical memory at DIRECT_MAP_BASE.
+#define KERNEL_PAGE_TABLES 1
+#define DIRECT_MAP_BASE 0xFFFF800000000000ULL
+
+
+// Hand the kernel a physical frame bitmap built from the final
+// memory map.
+#define FRAME_BITMAP 1
+
+
+// Log how fast text renders through framebuf_putch() versus
+// framebuf_write_span() at boot.
+#define FRAMEBUF_TEXT_BENCH 0
+
+
+// Spread CPU-bound boot work (checksums, decompression, pixel
+// conversion) over every processor with the MP Services protocol.
+#define MP_BOOT_WORK 1
 
 
 #endif
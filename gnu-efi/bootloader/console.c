@@ -0,0 +1,303 @@
+/*
+ *  MIT License
+ *
+ *  Copyright (c) 2022 FacelessSociety, Ian Marco Moffett
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+
+#include <efi.h>
+#include <efilib.h>
+#include <common/console.h>
+#include <common/compositor.h>
+#include <common/glyph.h>
+#include <common/text.h>
+#include <common/log.h>
+
+// Tab stops every TAB_CELLS cells.
+#define TAB_CELLS 8
+
+// Grey on black.
+#define CONSOLE_DEFAULT_ATTR 0x07
+
+extern struct FacelessServices fs;
+
+
+// VGA text mode colours, 0x00RRGGBB.
+static const uint32_t vga_palette[16] = {
+    0x000000, 0x0000AA, 0x00AA00, 0x00AAAA, 0xAA0000, 0xAA00AA, 0xAA5500, 0xAAAAAA,
+    0x555555, 0x5555FF, 0x55FF55, 0x55FFFF, 0xFF5555, 0xFF55FF, 0xFFFF55, 0xFFFFFF
+};
+
+
+// What is on screen, cells moves with the pixels when scrolling.
+static struct ConsoleCell* drawn = NULL;
+
+// Text lines scrolled in the grid but not yet in the pixels.
+static uint32_t pending_scroll = 0;
+
+// Cell rows changed since the last redraw, half-open.
+static uint32_t dirty_top = 0;
+static uint32_t dirty_bottom = 0;
+
+// Bytes of one run of changed cells.
+static char* run_buf = NULL;
+
+
+static inline void mark_dirty(uint32_t top, uint32_t bottom) {
+    if (dirty_top >= dirty_bottom) {
+        dirty_top = top;
+        dirty_bottom = bottom;
+        return;
+    }
+
+    dirty_top = top < dirty_top ? top : dirty_top;
+    dirty_bottom = bottom > dirty_bottom ? bottom : dirty_bottom;
+}
+
+
+static inline void fill_cells(struct ConsoleCell* cells, UINTN n, uint8_t attr) {
+    for (UINTN i = 0; i < n; ++i) {
+        cells[i].ch = ' ';
+        cells[i].attr = attr;
+    }
+}
+
+
+/*
+ *  Allocates the cell grids for a console covering the whole
+ *  framebuffer. Needs the font and the GOP set up.
+ *
+ */
+
+EFI_STATUS console_init(void) {
+    struct BootConsole* con = &fs.console;
+    uint32_t height = glyph_height();
+
+    con->cols = height ? fs.framebuffer.width / glyph_width() : 0;
+    con->rows = height ? fs.framebuffer.height / height : 0;
+
+    if (con->cols == 0 || con->rows == 0) {
+        log_error(L"No font, the console is disabled.\n");
+        con->cells = NULL;
+        return EFI_NOT_READY;
+    }
+
+    UINTN ncells = (UINTN)con->cols * con->rows;
+    UINTN bytes = 2 * ncells * sizeof(struct ConsoleCell) + con->cols;
+    EFI_PHYSICAL_ADDRESS addr;
+
+    if (EFI_ERROR(BS->AllocatePages(AllocateAnyPages, EfiLoaderData, EFI_SIZE_TO_PAGES(bytes), &addr))) {
+        log_error(L"Failed to allocate a %dx%d console.\n", con->cols, con->rows);
+        con->cells = NULL;
+        con->cols = con->rows = 0;
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    con->cells = (struct ConsoleCell*)addr;
+    drawn = con->cells + ncells;
+    run_buf = (char*)(drawn + ncells);
+
+    CopyMem(con->palette, vga_palette, sizeof(vga_palette));
+    con->attr = CONSOLE_DEFAULT_ATTR;
+    con->cursor_x = con->cursor_y = 0;
+
+    // The backbuffer starts out black, which is what blank cells look like.
+    fill_cells(con->cells, ncells, CONSOLE_DEFAULT_ATTR);
+    fill_cells(drawn, ncells, CONSOLE_DEFAULT_ATTR);
+    pending_scroll = 0;
+    dirty_top = dirty_bottom = 0;
+
+    log_debug(L"Console is %dx%d cells.\n", con->cols, con->rows);
+    return EFI_SUCCESS;
+}
+
+
+// Moves the grid up a line, the pixels follow in redraw().
+static void scroll_grid(struct BootConsole* con) {
+    UINTN row = con->cols;
+    UINTN ncells = row * con->rows;
+
+    RtCopyMem(con->cells, con->cells + row, (ncells - row) * sizeof(struct ConsoleCell));
+    fill_cells(con->cells + ncells - row, row, con->attr);
+    pending_scroll += pending_scroll < con->rows;
+    mark_dirty(0, con->rows);
+}
+
+
+/*
+ *  Moves the pixels up by every pending scroll at once, as one
+ *  block copy inside the backbuffer. The drawn grid moves with
+ *  them, so redraw() only repaints cells that really changed.
+ *
+ */
+
+static void scroll_pixels(struct BootConsole* con, uint32_t* target) {
+    uint32_t lines = pending_scroll;
+    pending_scroll = 0;
+
+    // Everything scrolled off, the diff repaints whatever differs.
+    if (lines == 0 || lines >= con->rows) {
+        return;
+    }
+
+    UINTN row_pixels = (UINTN)fs.framebuffer.ppsl * glyph_height();
+    UINTN keep = con->rows - lines;
+
+    RtCopyMem(target, target + lines * row_pixels, keep * row_pixels * sizeof(uint32_t));
+    RtCopyMem(drawn, drawn + lines * con->cols, keep * con->cols * sizeof(struct ConsoleCell));
+}
+
+
+/*
+ *  Brings the pixels in line with the cell grid, drawing only the
+ *  cells that differ, then flushes the changed band of rows.
+ *
+ */
+
+static void redraw(struct BootConsole* con) {
+    uint32_t* target = fs.framebuffer.backbuffer != NULL ? fs.framebuffer.backbuffer : fs.framebuffer.base_addr;
+    uint32_t width = glyph_width();
+    uint32_t height = glyph_height();
+
+    scroll_pixels(con, target);
+
+    for (uint32_t y = dirty_top; y < dirty_bottom; ++y) {
+        struct ConsoleCell* want = con->cells + (UINTN)y * con->cols;
+        struct ConsoleCell* have = drawn + (UINTN)y * con->cols;
+        uint32_t x = 0;
+
+        while (x < con->cols) {
+            if (want[x].ch == have[x].ch && want[x].attr == have[x].attr) {
+                ++x;
+                continue;
+            }
+
+            // A run of changed cells sharing one attribute.
+            uint8_t attr = want[x].attr;
+            uint32_t start = x;
+
+            while (x < con->cols && want[x].attr == attr &&
+                    (want[x].ch != have[x].ch || want[x].attr != have[x].attr)) {
+                run_buf[x - start] = want[x].ch;
+                have[x] = want[x];
+                ++x;
+            }
+
+            unsigned int px = start * width, py = y * height;
+            framebuf_write_span(run_buf, x - start, con->palette[attr & 0xF], con->palette[attr >> 4],
+                    NULL, &px, &py, target);
+        }
+    }
+
+    if (dirty_top < dirty_bottom && target == fs.framebuffer.backbuffer) {
+        framebuf_damage(0, dirty_top * height, con->cols * width, (dirty_bottom - dirty_top) * height);
+        framebuf_flush();
+    }
+
+    dirty_top = dirty_bottom = 0;
+}
+
+
+/*
+ *  Writes text at the console cursor in the current attribute.
+ *
+ *  @buf: Latin-1 text, bytes are code points for font_lookup().
+ *  @len: Bytes in @buf.
+ *
+ *  '\n' starts a new line, '\r' returns to the left edge, '\t'
+ *  moves to the next tab stop and '\b' steps back a cell. Text
+ *  wraps at the right edge and scrolls at the bottom. The screen
+ *  is updated once, when the whole buffer is in the grid.
+ *
+ */
+
+void console_write(const char* buf, uint64_t len) {
+    struct BootConsole* con = &fs.console;
+
+    if (con->cells == NULL) {
+        return;
+    }
+
+    uint32_t cx = con->cursor_x < con->cols ? con->cursor_x : con->cols;
+    uint32_t cy = con->cursor_y < con->rows ? con->cursor_y : con->rows - 1;
+
+    for (uint64_t i = 0; i < len; ++i) {
+        char c = buf[i];
+
+        switch (c) {
+            case '\n':
+                cx = 0;
+                ++cy;
+                break;
+            case '\r':
+                cx = 0;
+                break;
+            case '\t':
+                cx = (cx / TAB_CELLS + 1) * TAB_CELLS;
+                cx = cx < con->cols ? cx : con->cols;
+                break;
+            case '\b':
+                cx -= cx > 0;
+                break;
+            default:
+                if (cx >= con->cols) {
+                    cx = 0;
+                    ++cy;
+                }
+
+                if (cy >= con->rows) {
+                    scroll_grid(con);
+                    cy = con->rows - 1;
+                }
+
+                struct ConsoleCell* cell = con->cells + (UINTN)cy * con->cols + cx;
+                cell->ch = c;
+                cell->attr = con->attr;
+                mark_dirty(cy, cy + 1);
+                ++cx;
+                continue;
+        }
+
+        if (cy >= con->rows) {
+            scroll_grid(con);
+            cy = con->rows - 1;
+        }
+    }
+
+    con->cursor_x = cx;
+    con->cursor_y = cy;
+    redraw(con);
+}
+
+
+// Blanks the console in the current attribute and homes the cursor.
+void console_clear(void) {
+    struct BootConsole* con = &fs.console;
+
+    if (con->cells == NULL) {
+        return;
+    }
+
+    fill_cells(con->cells, (UINTN)con->cols * con->rows, con->attr);
+    con->cursor_x = con->cursor_y = 0;
+    mark_dirty(0, con->rows);
+    redraw(con);
+}
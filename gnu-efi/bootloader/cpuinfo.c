@@ -0,0 +1,356 @@
+/*
+ *  MIT License
+ *
+ *  Copyright (c) 2022 FacelessSociety, Ian Marco Moffett
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+
+#include <efi.h>
+#include <efilib.h>
+#include <efimp.h>
+#include <common/cpuinfo.h>
+#include <common/timing.h>
+#include <common/log.h>
+
+#define EXT_LEAF_BASE 0x80000000
+
+extern struct FacelessServices fs;
+
+
+// A CPUID bit and the feature it stands for.
+struct FeatureBit {
+    uint32_t leaf;
+    uint32_t subleaf;
+    uint8_t reg;                                    // 0 EAX, 1 EBX, 2 ECX, 3 EDX.
+    uint8_t bit;
+    uint64_t feature;
+};
+
+
+static const struct FeatureBit feature_bits[] = {
+    { 1, 0, 3, 25, BOOT_CPU_SSE },
+    { 1, 0, 3, 26, BOOT_CPU_SSE2 },
+    { 1, 0, 2, 0, BOOT_CPU_SSE3 },
+    { 1, 0, 2, 1, BOOT_CPU_PCLMUL },
+    { 1, 0, 2, 9, BOOT_CPU_SSSE3 },
+    { 1, 0, 2, 12, BOOT_CPU_FMA },
+    { 1, 0, 2, 17, BOOT_CPU_PCID },
+    { 1, 0, 2, 19, BOOT_CPU_SSE41 },
+    { 1, 0, 2, 20, BOOT_CPU_SSE42 },
+    { 1, 0, 2, 21, BOOT_CPU_X2APIC },
+    { 1, 0, 2, 23, BOOT_CPU_POPCNT },
+    { 1, 0, 2, 24, BOOT_CPU_TSC_DEADLINE },
+    { 1, 0, 2, 25, BOOT_CPU_AES },
+    { 1, 0, 2, 26, BOOT_CPU_XSAVE },
+    { 1, 0, 2, 28, BOOT_CPU_AVX },
+    { 1, 0, 2, 30, BOOT_CPU_RDRAND },
+    { 7, 0, 1, 3, BOOT_CPU_BMI1 },
+    { 7, 0, 1, 5, BOOT_CPU_AVX2 },
+    { 7, 0, 1, 7, BOOT_CPU_SMEP },
+    { 7, 0, 1, 8, BOOT_CPU_BMI2 },
+    { 7, 0, 1, 9, BOOT_CPU_ERMS },
+    { 7, 0, 1, 10, BOOT_CPU_INVPCID },
+    { 7, 0, 1, 16, BOOT_CPU_AVX512F },
+    { 7, 0, 1, 17, BOOT_CPU_AVX512DQ },
+    { 7, 0, 1, 18, BOOT_CPU_RDSEED },
+    { 7, 0, 1, 20, BOOT_CPU_SMAP },
+    { 7, 0, 1, 30, BOOT_CPU_AVX512BW },
+    { 7, 0, 1, 31, BOOT_CPU_AVX512VL },
+    { 7, 0, 2, 16, BOOT_CPU_LA57 },
+    { 7, 0, 3, 4, BOOT_CPU_FSRM },
+    { 0x80000001, 0, 3, 20, BOOT_CPU_NX },
+    { 0x80000001, 0, 3, 26, BOOT_CPU_PAGE1GB },
+    { 0x80000007, 0, 3, 8, BOOT_CPU_INVARIANT_TSC }
+};
+
+
+// CPUID with the leaf checked against the highest one the CPU has.
+static void cpuid_checked(struct BootCpuInfo* info, uint32_t leaf, uint32_t subleaf, uint32_t regs[4]) {
+    uint32_t max = leaf >= EXT_LEAF_BASE ? info->max_ext_leaf : info->max_leaf;
+
+    if (leaf > max) {
+        regs[0] = regs[1] = regs[2] = regs[3] = 0;
+        return;
+    }
+
+    cpuid(leaf, subleaf, &regs[0], &regs[1], &regs[2], &regs[3]);
+}
+
+
+static void read_identity(struct BootCpuInfo* info) {
+    uint32_t r[4];
+
+    cpuid(0, 0, &r[0], &r[1], &r[2], &r[3]);
+    info->max_leaf = r[0];
+    CopyMem(info->vendor, &r[1], 4);
+    CopyMem(info->vendor + 4, &r[3], 4);
+    CopyMem(info->vendor + 8, &r[2], 4);
+
+    cpuid(EXT_LEAF_BASE, 0, &r[0], &r[1], &r[2], &r[3]);
+    info->max_ext_leaf = r[0] >= EXT_LEAF_BASE ? r[0] : 0;
+
+    cpuid_checked(info, 1, 0, r);
+    uint32_t family = (r[0] >> 8) & 0xF, model = (r[0] >> 4) & 0xF;
+
+    if (family == 0xF) {
+        family += (r[0] >> 20) & 0xFF;
+    }
+
+    if (family == 0x6 || family >= 0xF) {
+        model += ((r[0] >> 16) & 0xF) << 4;
+    }
+
+    info->family = family;
+    info->model = model;
+    info->stepping = r[0] & 0xF;
+
+    for (uint32_t i = 0; i < 3; ++i) {
+        cpuid_checked(info, 0x80000002 + i, 0, r);
+        CopyMem(info->brand + i * 16, r, 16);
+    }
+
+    cpuid_checked(info, 0x80000008, 0, r);
+    info->phys_addr_bits = r[0] & 0xFF;
+    info->virt_addr_bits = (r[0] >> 8) & 0xFF;
+}
+
+
+static void read_features(struct BootCpuInfo* info) {
+    uint64_t features = 0;
+    uint32_t r[4];
+
+    for (UINTN i = 0; i < sizeof(feature_bits) / sizeof(feature_bits[0]); ++i) {
+        const struct FeatureBit* f = &feature_bits[i];
+
+        cpuid_checked(info, f->leaf, f->subleaf, r);
+        features |= r[f->reg] & (1U << f->bit) ? f->feature : 0;
+    }
+
+    info->features = features;
+
+    if (features & BOOT_CPU_XSAVE) {
+        cpuid_checked(info, 0xD, 0, r);
+        info->xsave_size = r[1];
+        info->xsave_max_size = r[2];
+        info->xcr0_supported = ((uint64_t)r[3] << 32) | r[0];
+    }
+}
+
+
+/*
+ *  Deterministic cache parameters, leaf 4 on Intel and 0x8000001D
+ *  on AMD with topology extensions. Both use the same layout.
+ *
+ */
+
+static void read_caches(struct BootCpuInfo* info) {
+    uint32_t r[4];
+    uint32_t leaf = 4;
+
+    if (CompareMem(info->vendor, "AuthenticAMD", 12) == 0 || CompareMem(info->vendor, "HygonGenuine", 12) == 0) {
+        cpuid_checked(info, 0x80000001, 0, r);
+        leaf = r[2] & (1 << 22) ? 0x8000001D : 0;
+    }
+
+    if (leaf == 0) {
+        return;
+    }
+
+    uint8_t n = 0;
+
+    for (uint32_t sub = 0; n < BOOT_CPU_MAX_CACHES; ++sub) {
+        cpuid_checked(info, leaf, sub, r);
+
+        if ((r[0] & 0x1F) == 0) {
+            break;
+        }
+
+        struct BootCpuCache cache;
+        cache.type = r[0] & 0x1F;
+        cache.level = (r[0] >> 5) & 0x7;
+        cache.shared_by = ((r[0] >> 14) & 0xFFF) + 1;
+        cache.line_size = (r[1] & 0xFFF) + 1;
+        cache.ways = ((r[1] >> 22) & 0x3FF) + 1;
+        cache.sets = r[2] + 1;
+        cache.size = cache.ways * (((r[1] >> 12) & 0x3FF) + 1) * cache.line_size * cache.sets;
+        info->caches[n++] = cache;
+    }
+
+    info->ncaches = n;
+}
+
+
+static void add_tlb(struct BootCpuInfo* info, uint8_t level, uint8_t type, uint8_t page_sizes,
+        uint32_t ways, uint32_t entries, BOOLEAN full) {
+    if (entries == 0 || info->ntlbs >= BOOT_CPU_MAX_TLBS) {
+        return;
+    }
+
+    struct BootCpuTlb tlb = {
+        .level = level,
+        .type = type,
+        .page_sizes = page_sizes,
+        .fully_associative = full,
+        .ways = full ? entries : ways,
+        .entries = entries
+    };
+
+    info->tlbs[info->ntlbs++] = tlb;
+}
+
+
+// Ways for AMD's encoded L2 TLB associativity, 0xF is fully associative.
+static const uint8_t amd_l2_ways[16] = { 0, 1, 2, 3, 4, 6, 8, 0, 16, 0, 32, 48, 64, 96, 128, 0 };
+
+
+// AMD L2 TLB register: 4 bit associativity and 12 bit entries, data then instruction.
+static void add_amd_l2_tlbs(struct BootCpuInfo* info, uint32_t reg, uint8_t page_sizes) {
+    uint32_t assoc = reg >> 28;
+    add_tlb(info, 2, BOOT_CACHE_DATA, page_sizes, amd_l2_ways[assoc], (reg >> 16) & 0xFFF, assoc == 0xF);
+
+    assoc = (reg >> 12) & 0xF;
+    add_tlb(info, 2, BOOT_CACHE_INSTRUCTION, page_sizes, amd_l2_ways[assoc], reg & 0xFFF, assoc == 0xF);
+}
+
+
+/*
+ *  TLBs from leaf 0x18 on Intel, or leaves 0x80000005/6 on AMD.
+ *  Intel's older leaf 2 descriptor bytes aren't decoded.
+ *
+ */
+
+static void read_tlbs(struct BootCpuInfo* info) {
+    uint32_t r[4];
+
+    info->ntlbs = 0;
+
+    if (info->max_leaf >= 0x18) {
+        cpuid_checked(info, 0x18, 0, r);
+        uint32_t max_sub = r[0];
+
+        for (uint32_t sub = 0; sub <= max_sub && sub < 64; ++sub) {
+            cpuid_checked(info, 0x18, sub, r);
+            uint32_t type = r[3] & 0x1F;
+
+            if (type == 0) {
+                continue;
+            }
+
+            // Load-only and store-only TLBs count as data TLBs.
+            add_tlb(info, (r[3] >> 5) & 0x7, type >= 4 ? BOOT_CACHE_DATA : type, r[1] & 0xF,
+                    r[1] >> 16, (r[1] >> 16) * r[2], (r[3] >> 8) & 1);
+        }
+
+        return;
+    }
+
+    if (info->max_ext_leaf >= 0x80000006) {
+        cpuid_checked(info, 0x80000005, 0, r);
+
+        // L1: 8 bit associativity (0xFF fully) and 8 bit entries, EAX 2M/4M pages, EBX 4K.
+        add_tlb(info, 1, BOOT_CACHE_DATA, BOOT_TLB_4K, r[1] >> 24, (r[1] >> 16) & 0xFF, (r[1] >> 24) == 0xFF);
+        add_tlb(info, 1, BOOT_CACHE_INSTRUCTION, BOOT_TLB_4K, (r[1] >> 8) & 0xFF, r[1] & 0xFF, ((r[1] >> 8) & 0xFF) == 0xFF);
+        add_tlb(info, 1, BOOT_CACHE_DATA, BOOT_TLB_2M | BOOT_TLB_4M, r[0] >> 24, (r[0] >> 16) & 0xFF, (r[0] >> 24) == 0xFF);
+        add_tlb(info, 1, BOOT_CACHE_INSTRUCTION, BOOT_TLB_2M | BOOT_TLB_4M, (r[0] >> 8) & 0xFF, r[0] & 0xFF, ((r[0] >> 8) & 0xFF) == 0xFF);
+
+        cpuid_checked(info, 0x80000006, 0, r);
+        add_amd_l2_tlbs(info, r[1], BOOT_TLB_4K);
+        add_amd_l2_tlbs(info, r[0], BOOT_TLB_2M | BOOT_TLB_4M);
+    }
+}
+
+
+/*
+ *  Logical processors and their APIC IDs from MP Services, or just
+ *  the BSP's APIC ID and CPUID's count without it.
+ *
+ */
+
+static void read_topology(struct BootCpuInfo* info) {
+    EFI_GUID mp_guid = EFI_MP_SERVICES_PROTOCOL_GUID;
+    EFI_MP_SERVICES_PROTOCOL* mp;
+    UINTN ncpus, nenabled;
+    uint32_t r[4];
+
+    cpuid_checked(info, 1, 0, r);
+    info->bsp_apic_id = r[1] >> 24;
+    info->nlogical = info->nenabled = (r[1] >> 16) & 0xFF ? (r[1] >> 16) & 0xFF : 1;
+    info->cpus = NULL;
+
+    // x2APIC IDs don't fit in 8 bits.
+    if (info->max_leaf >= 0xB) {
+        cpuid_checked(info, 0xB, 0, r);
+        info->bsp_apic_id = r[1] != 0 ? r[3] : info->bsp_apic_id;
+    }
+
+    if (EFI_ERROR(BS->LocateProtocol(&mp_guid, NULL, (void**)&mp)) ||
+            EFI_ERROR(mp->GetNumberOfProcessors(mp, &ncpus, &nenabled))) {
+        return;
+    }
+
+    struct BootCpu* cpus;
+
+    if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, ncpus * sizeof(struct BootCpu), (void**)&cpus))) {
+        return;
+    }
+
+    for (UINTN i = 0; i < ncpus; ++i) {
+        EFI_PROCESSOR_INFORMATION pi;
+        struct BootCpu cpu = { 0 };
+
+        if (!EFI_ERROR(mp->GetProcessorInfo(mp, i, &pi))) {
+            cpu.apic_id = pi.ProcessorId;
+            cpu.package = pi.Location.Package;
+            cpu.core = pi.Location.Core;
+            cpu.thread = pi.Location.Thread;
+            cpu.flags = pi.StatusFlag & (PROCESSOR_AS_BSP_BIT | PROCESSOR_ENABLED_BIT | PROCESSOR_HEALTH_STATUS_BIT);
+        }
+
+        cpus[i] = cpu;
+    }
+
+    info->cpus = cpus;
+    info->nlogical = ncpus;
+    info->nenabled = nenabled;
+}
+
+
+/*
+ *  Runs CPUID once on the BSP and records everything the kernel
+ *  would otherwise probe at entry in fs.cpu.
+ *
+ */
+
+void cpu_info_snapshot(void) {
+    struct BootCpuInfo* info = &fs.cpu;
+
+    ZeroMem(info, sizeof(*info));
+    read_identity(info);
+    read_features(info);
+    read_caches(info);
+    read_tlbs(info);
+    read_topology(info);
+
+    log_info(L"CPU: %a family %xh model %xh, %d/%d logical processors.\n",
+            info->vendor, info->family, info->model, info->nenabled, info->nlogical);
+    log_debug(L"CPU features 0x%lx, XSAVE %d/%d bytes, %d caches, %d TLBs.\n",
+            info->features, info->xsave_size, info->xsave_max_size, info->ncaches, info->ntlbs);
+}
@@ -0,0 +1,108 @@
+/*
+ *  MIT License
+ *
+ *  Copyright (c) 2022 FacelessSociety, Ian Marco Moffett
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+
+#include <efi.h>
+#include <efilib.h>
+#include <common/firmware.h>
+#include <common/log.h>
+
+extern struct FacelessServices fs;
+
+
+enum KnownTable {
+    TABLE_ACPI10,
+    TABLE_ACPI20,
+    TABLE_SMBIOS,
+    TABLE_SMBIOS3,
+    TABLE_MEMORY_ATTRIBUTES,
+    TABLE_RNG_SEED,
+    TABLE_COUNT
+};
+
+
+static EFI_GUID known_guids[TABLE_COUNT] = {
+    [TABLE_ACPI10] = ACPI_TABLE_GUID,
+    [TABLE_ACPI20] = ACPI_20_TABLE_GUID,
+    [TABLE_SMBIOS] = SMBIOS_TABLE_GUID,
+    [TABLE_SMBIOS3] = SMBIOS3_TABLE_GUID,
+    [TABLE_MEMORY_ATTRIBUTES] = EFI_MEMORY_ATTRIBUTES_TABLE_GUID,
+    [TABLE_RNG_SEED] = LINUX_EFI_RANDOM_SEED_TABLE_GUID
+};
+
+
+// Drops a table whose signature doesn't match.
+static void check_signature(void** table, const char* signature, UINTN len, const CHAR16* name) {
+    if (*table != NULL && CompareMem(signature, *table, len) != 0) {
+        log_error(L"Ignoring %s table with a bad signature.\n", name);
+        *table = NULL;
+    }
+}
+
+
+/*
+ *  Indexes the firmware's configuration table in one pass, filling
+ *  fs.firmware with every table the loader knows of. The first
+ *  entry for each GUID wins.
+ *
+ *  @st: System Table.
+ *
+ */
+
+void firmware_index_tables(EFI_SYSTEM_TABLE* st) {
+    struct BootFirmwareTables* tables = &fs.firmware;
+    EFI_CONFIGURATION_TABLE* entry = st->ConfigurationTable;
+    void* found[TABLE_COUNT] = { NULL };
+
+    for (UINTN i = 0; i < st->NumberOfTableEntries; ++i, ++entry) {
+        for (UINTN k = 0; k < TABLE_COUNT; ++k) {
+            // CompareGuid() returns 0 for equal GUIDs.
+            if (CompareGuid(&entry->VendorGuid, &known_guids[k]) == 0) {
+                found[k] = found[k] != NULL ? found[k] : entry->VendorTable;
+                break;
+            }
+        }
+    }
+
+    check_signature(&found[TABLE_ACPI10], "RSD PTR ", 8, L"ACPI 1.0");
+    check_signature(&found[TABLE_ACPI20], "RSD PTR ", 8, L"ACPI 2.0");
+    check_signature(&found[TABLE_SMBIOS], "_SM_", 4, L"SMBIOS");
+    check_signature(&found[TABLE_SMBIOS3], "_SM3_", 5, L"SMBIOS3");
+
+    tables->acpi10_rsdp = found[TABLE_ACPI10];
+    tables->acpi20_rsdp = found[TABLE_ACPI20];
+    tables->smbios = found[TABLE_SMBIOS];
+    tables->smbios3 = found[TABLE_SMBIOS3];
+    tables->memory_attributes = found[TABLE_MEMORY_ATTRIBUTES];
+    tables->rng_seed = found[TABLE_RNG_SEED];
+    tables->nentries = st->NumberOfTableEntries;
+
+    // Kept for kernels that only know fs.rsdp.
+    fs.rsdp = tables->acpi20_rsdp != NULL ? tables->acpi20_rsdp : tables->acpi10_rsdp;
+
+    log_debug(L"%ld firmware tables: ACPI %a%a, SMBIOS %a%a, memory attributes %a, RNG seed %a.\n",
+            tables->nentries, found[TABLE_ACPI10] ? "1.0 " : "", found[TABLE_ACPI20] ? "2.0" : "",
+            found[TABLE_SMBIOS] ? "2 " : "", found[TABLE_SMBIOS3] ? "3" : "",
+            found[TABLE_MEMORY_ATTRIBUTES] ? "yes" : "no", found[TABLE_RNG_SEED] ? "yes" : "no");
+}
@@ -0,0 +1,330 @@
+/*
+ *  MIT License
+ *
+ *  Copyright (c) 2022 FacelessSociety, Ian Marco Moffett
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+
+#include <efi.h>
+#include <efilib.h>
+#include <common/font.h>
+#include <common/log.h>
+
+#define PSF1_MAGIC0 0x36
+#define PSF1_MAGIC1 0x04
+#define PSF1_MODE512 0x01
+#define PSF1_MODEHASTAB 0x02
+#define PSF1_MODESEQ 0x04
+#define PSF1_SEPARATOR 0xFFFF
+#define PSF1_STARTSEQ 0xFFFE
+
+#define PSF2_MAGIC 0x864AB572
+#define PSF2_HAS_UNICODE_TABLE 0x01
+#define PSF2_SEPARATOR 0xFF
+#define PSF2_STARTSEQ 0xFE
+
+// Largest glyph edge accepted, in pixels.
+#define FONT_MAX_SIZE 256
+
+// Glyph indices are 16-bit, UNMAPPED marks a free slot while building.
+#define FONT_MAX_GLYPHS 0xFFFE
+#define UNMAPPED 0xFFFF
+
+#define FONT_MAX_CODEPOINT (FONT_UNICODE_PAGES * 256)
+
+static struct PSFont* current = NULL;
+
+
+// Reads one UTF-8 sequence, returns its length or 0 if malformed.
+static UINTN utf8_decode(const uint8_t* p, const uint8_t* end, uint32_t* cp) {
+    UINTN n;
+    uint32_t c = p[0];
+
+    if (c < 0x80) {
+        *cp = c;
+        return 1;
+    } else if ((c & 0xE0) == 0xC0) {
+        n = 2;
+        c &= 0x1F;
+    } else if ((c & 0xF0) == 0xE0) {
+        n = 3;
+        c &= 0x0F;
+    } else if ((c & 0xF8) == 0xF0) {
+        n = 4;
+        c &= 0x07;
+    } else {
+        return 0;
+    }
+
+    if ((UINTN)(end - p) < n) {
+        return 0;
+    }
+
+    for (UINTN i = 1; i < n; ++i) {
+        if ((p[i] & 0xC0) != 0x80) {
+            return 0;
+        }
+
+        c = (c << 6) | (p[i] & 0x3F);
+    }
+
+    *cp = c;
+    return n;
+}
+
+
+/*
+ *  Walks a Unicode table, calling @map for every code point that
+ *  names a glyph on its own. Multi code point sequences are
+ *  skipped, one glyph can't be looked up by a single key for them.
+ *
+ */
+
+static void walk_table(struct PSFont* font, const uint8_t* table, const uint8_t* end,
+        void(*map)(uint32_t cp, uint32_t glyph)) {
+    uint32_t glyph = 0;
+    BOOLEAN in_seq = FALSE;
+
+    if (font->version == 1) {
+        for (; table + 2 <= end && glyph < font->nglyphs; table += 2) {
+            uint16_t v = table[0] | (table[1] << 8);
+
+            if (v == PSF1_SEPARATOR) {
+                ++glyph;
+                in_seq = FALSE;
+            } else if (v == PSF1_STARTSEQ) {
+                in_seq = TRUE;
+            } else if (!in_seq) {
+                map(v, glyph);
+            }
+        }
+
+        return;
+    }
+
+    while (table < end && glyph < font->nglyphs) {
+        uint32_t cp;
+        UINTN n;
+
+        if (*table == PSF2_SEPARATOR) {
+            ++glyph;
+            in_seq = FALSE;
+            ++table;
+        } else if (*table == PSF2_STARTSEQ) {
+            in_seq = TRUE;
+            ++table;
+        } else if ((n = utf8_decode(table, end, &cp)) == 0) {
+            ++table;
+        } else {
+            if (!in_seq) {
+                map(cp, glyph);
+            }
+
+            table += n;
+        }
+    }
+}
+
+
+// Lookup tables being built, shared with the walk_table() callbacks.
+static uint16_t* build_pages;
+static uint16_t* build_blocks;
+static UINTN build_nblocks;
+
+
+static void count_page(uint32_t cp, uint32_t glyph) {
+    (void)glyph;
+
+    if (cp < FONT_MAX_CODEPOINT && build_pages[cp >> 8] == 0) {
+        build_pages[cp >> 8] = ++build_nblocks;
+    }
+}
+
+
+static void fill_slot(uint32_t cp, uint32_t glyph) {
+    if (cp < FONT_MAX_CODEPOINT) {
+        uint16_t* slot = &build_blocks[build_pages[cp >> 8] * 256 + (cp & 0xFF)];
+
+        // The first glyph listed for a code point wins.
+        if (*slot == UNMAPPED) {
+            *slot = glyph;
+        }
+    }
+}
+
+
+/*
+ *  Builds the two level code point to glyph table. Pages of 256
+ *  code points that the font has a glyph for get their own block,
+ *  every other page shares block 0.
+ *
+ *  Fonts without a Unicode table map code point c to glyph c.
+ *
+ */
+
+static EFI_STATUS build_unicode_map(struct PSFont* font, const uint8_t* table, const uint8_t* end) {
+    if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, FONT_UNICODE_PAGES * sizeof(uint16_t), (void**)&build_pages))) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    SetMem(build_pages, FONT_UNICODE_PAGES * sizeof(uint16_t), 0);
+    build_nblocks = 0;
+
+    if (table != NULL) {
+        walk_table(font, table, end, count_page);
+    } else {
+        for (uint32_t g = 0; g < font->nglyphs; g += 256) {
+            count_page(g, g);
+        }
+    }
+
+    UINTN bytes = (build_nblocks + 1) * 256 * sizeof(uint16_t);
+
+    if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, bytes, (void**)&build_blocks))) {
+        FreePool(build_pages);
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    SetMem(build_blocks, bytes, 0xFF);
+
+    if (table != NULL) {
+        walk_table(font, table, end, fill_slot);
+    } else {
+        for (uint32_t g = 0; g < font->nglyphs; ++g) {
+            fill_slot(g, g);
+        }
+    }
+
+    // U+FFFD, or '?', or whatever glyph 0 is, for everything else.
+    uint16_t fallback = build_blocks[build_pages[0xFF] * 256 + 0xFD];
+
+    if (build_pages[0xFF] == 0 || fallback == UNMAPPED) {
+        fallback = build_blocks[build_pages[0] * 256 + '?'];
+        fallback = build_pages[0] != 0 && fallback != UNMAPPED ? fallback : 0;
+    }
+
+    for (UINTN i = 0; i < (build_nblocks + 1) * 256; ++i) {
+        if (build_blocks[i] == UNMAPPED) {
+            build_blocks[i] = fallback;
+        }
+    }
+
+    font->unicode_pages = build_pages;
+    font->unicode_blocks = build_blocks;
+    return EFI_SUCCESS;
+}
+
+
+/*
+ *  Fills in a PSFont from a PSF1 or PSF2 file and builds its
+ *  Unicode lookup. The font becomes the one font_lookup() uses.
+ *
+ *  @data: Whole font file, must stay loaded.
+ *  @size: Size of the file.
+ *  @font: Filled in on success.
+ *
+ */
+
+EFI_STATUS font_parse(uint8_t* data, UINTN size, struct PSFont* font) {
+    const uint8_t* table = NULL;
+    UINTN glyph_offset;
+
+    if (size >= sizeof(struct PSFontHeader) && data[0] == PSF1_MAGIC0 && data[1] == PSF1_MAGIC1) {
+        struct PSFontHeader* header = (struct PSFontHeader*)data;
+
+        font->version = 1;
+        font->nglyphs = header->mode & PSF1_MODE512 ? 512 : 256;
+        font->width = 8;
+        font->height = header->chsize;
+        font->bytes_per_glyph = header->chsize;
+        glyph_offset = sizeof(struct PSFontHeader);
+        table = header->mode & (PSF1_MODEHASTAB | PSF1_MODESEQ) ? data : NULL;
+    } else if (size >= sizeof(struct PSF2Header) && ((struct PSF2Header*)data)->magic == PSF2_MAGIC) {
+        struct PSF2Header* header = (struct PSF2Header*)data;
+
+        // Glyphs start at header_size, which can't overlap the header.
+        if (header->header_size < sizeof(struct PSF2Header)) {
+            log_error(L"PSF2 header size %d is too small.\n", header->header_size);
+            return EFI_VOLUME_CORRUPTED;
+        }
+
+        font->version = 2;
+        font->nglyphs = header->nglyphs;
+        font->width = header->width;
+        font->height = header->height;
+        font->bytes_per_glyph = header->bytes_per_glyph;
+        glyph_offset = header->header_size;
+        table = header->flags & PSF2_HAS_UNICODE_TABLE ? data : NULL;
+    } else {
+        log_error(L"Font is not PSF1 or PSF2.\n");
+        return EFI_UNSUPPORTED;
+    }
+
+    font->bytes_per_row = (font->width + 7) / 8;
+
+    if (font->width == 0 || font->height == 0 || font->width > FONT_MAX_SIZE || font->height > FONT_MAX_SIZE ||
+            font->nglyphs == 0 || font->nglyphs > FONT_MAX_GLYPHS ||
+            font->bytes_per_glyph < font->bytes_per_row * font->height) {
+        log_error(L"Unsupported %dx%d font with %d glyphs.\n", font->width, font->height, font->nglyphs);
+        return EFI_UNSUPPORTED;
+    }
+
+    UINTN glyph_bytes = (UINTN)font->nglyphs * font->bytes_per_glyph;
+
+    if (glyph_offset > size || glyph_bytes > size - glyph_offset) {
+        log_error(L"Font glyphs are truncated.\n");
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    font->header = (struct PSFontHeader*)data;
+    font->glyph_buf = data + glyph_offset;
+
+    // The Unicode table, if any, follows the glyphs.
+    if (table != NULL) {
+        table = data + glyph_offset + glyph_bytes;
+    }
+
+    EFI_STATUS s = build_unicode_map(font, table, data + size);
+
+    if (EFI_ERROR(s)) {
+        log_error(L"Failed to build the font's Unicode map.\n");
+        return s;
+    }
+
+    current = font;
+    log_debug(L"PSF%d font, %dx%d, %d glyphs%a.\n", font->version, font->width, font->height, font->nglyphs,
+            table != NULL ? ", Unicode table" : "");
+    return EFI_SUCCESS;
+}
+
+
+// Glyph index for a code point, the replacement glyph if it has none.
+uint32_t font_lookup(uint32_t codepoint) {
+    if (current == NULL) {
+        return 0;
+    }
+
+    if (codepoint >= FONT_MAX_CODEPOINT) {
+        codepoint = 0xFFFD;
+    }
+
+    return current->unicode_blocks[current->unicode_pages[codepoint >> 8] * 256 + (codepoint & 0xFF)];
+}
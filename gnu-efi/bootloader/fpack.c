@@ -0,0 +1,346 @@
+/*
+ *  MIT License
+ *
+ *  Copyright (c) 2022 FacelessSociety, Ian Marco Moffett
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+
+#include <efi.h>
+#include <efilib.h>
+#include <common/fpack.h>
+#include <common/fs_session.h>
+#include <common/log.h>
+#include <common/lz4.h>
+#include <common/mp.h>
+#include <common/timing.h>
+
+static uint8_t* pack = NULL;
+static UINTN pack_size = 0;
+static struct FPackEntry* pack_index = NULL;
+static UINTN nentries = 0;
+static BOOLEAN verified[FPACK_MAX_ENTRIES];
+static void* unpacked[FPACK_MAX_ENTRIES];          // Decompressed copies of LZ4 entries.
+
+
+/*
+ *  Reads a pack into memory with one (possibly prefetched) read
+ *  and validates its index.
+ *
+ *  @path: Filepath of the pack in the root directory.
+ *
+ *  Entry data is only checksummed when it's first handed out.
+ *
+ */
+
+EFI_STATUS fpack_open(CHAR16* path) {
+    void* buf;
+    UINTN size;
+    EFI_STATUS s = fs_session_fetch(path, &buf, &size);
+
+    if (EFI_ERROR(s)) {
+        return s;
+    }
+
+    struct FPackHeader* header = buf;
+
+    if (size < sizeof(struct FPackHeader) ||
+            header->magic != FPACK_MAGIC ||
+            header->version != FPACK_VERSION ||
+            header->nentries > FPACK_MAX_ENTRIES ||
+            header->pack_size != size ||
+            sizeof(struct FPackHeader) + header->nentries * sizeof(struct FPackEntry) > size) {
+        // -------------------------------
+
+        log_error(L"%s: bad pack header!\n", path);
+        BS->FreePages((EFI_PHYSICAL_ADDRESS)buf, EFI_SIZE_TO_PAGES(size));
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    struct FPackEntry* entries = (struct FPackEntry*)(header + 1);
+
+    if (CalculateCrc((UINT8*)entries, header->nentries * sizeof(struct FPackEntry)) != header->index_crc) {
+        log_error(L"%s: pack index checksum mismatch!\n", path);
+        BS->FreePages((EFI_PHYSICAL_ADDRESS)buf, EFI_SIZE_TO_PAGES(size));
+        return EFI_CRC_ERROR;
+    }
+
+    for (UINTN i = 0; i < header->nentries; ++i) {
+        if (entries[i].offset > size || entries[i].size > size - entries[i].offset ||
+                (!(entries[i].flags & FPACK_FLAG_LZ4) && entries[i].raw_size != entries[i].size) ||
+                entries[i].name[FPACK_NAME_LEN - 1] != 0) {
+            log_error(L"%s: pack entry %d is malformed!\n", path, i);
+            BS->FreePages((EFI_PHYSICAL_ADDRESS)buf, EFI_SIZE_TO_PAGES(size));
+            return EFI_VOLUME_CORRUPTED;
+        }
+
+        verified[i] = FALSE;
+        unpacked[i] = NULL;
+    }
+
+    pack = buf;
+    pack_size = size;
+    pack_index = entries;
+    nentries = header->nentries;
+
+    log_info(L"%s: %d entries, %d bytes.\n", path, nentries, pack_size);
+    return EFI_SUCCESS;
+}
+
+
+BOOLEAN fpack_loaded(void) {
+    return pack != NULL;
+}
+
+
+UINTN fpack_count(void) {
+    return nentries;
+}
+
+
+struct FPackEntry* fpack_entry(UINTN i) {
+    return i < nentries ? &pack_index[i] : NULL;
+}
+
+
+// Boot log line for a decompressed entry.
+static void log_unpacked(struct FPackEntry* entry, uint64_t us) {
+    log_info(L"%a: %d -> %d bytes, decoded in %d us (%d MB/s).\n",
+            entry->name,
+            entry->size,
+            entry->raw_size,
+            us,
+            us ? entry->raw_size * 1000000 / us / (1024 * 1024) : 0);
+}
+
+
+/*
+ *  Decompresses an LZ4 entry into its own page aligned buffer.
+ *
+ *  @entry: Entry to decompress.
+ *
+ */
+
+static void* unpack_entry(struct FPackEntry* entry) {
+    EFI_PHYSICAL_ADDRESS addr;
+    UINTN pages = EFI_SIZE_TO_PAGES(entry->raw_size);
+
+    if (EFI_ERROR(BS->AllocatePages(AllocateAnyPages, EfiLoaderData, pages, &addr))) {
+        log_error(L"Pack entry %a: failed to allocate %d pages.\n", entry->name, pages);
+        return NULL;
+    }
+
+    uint64_t start = rdtsc();
+    INTN n = lz4_decompress(pack + entry->offset, entry->size, (uint8_t*)addr, entry->raw_size);
+    uint64_t us = timing_ticks_to_us(rdtsc() - start);
+
+    if (n < 0 || (UINTN)n != entry->raw_size) {
+        log_error(L"Pack entry %a: corrupt LZ4 data!\n", entry->name);
+        BS->FreePages(addr, pages);
+        return NULL;
+    }
+
+    log_unpacked(entry, us);
+    return (void*)addr;
+}
+
+
+// Checksum and decompression of one entry, run by mp_run().
+struct PrepareJob {
+    struct FPackEntry* entry;
+    void* dst;                          // Output buffer for LZ4 entries.
+    uint64_t ticks;                     // TSC ticks spent decompressing.
+    BOOLEAN crc_ok;
+    BOOLEAN unpack_ok;
+};
+
+
+// Must stay free of boot services, it may run on an AP.
+static void prepare_entry(void* arg) {
+    struct PrepareJob* job = arg;
+    struct FPackEntry* entry = job->entry;
+
+    job->crc_ok = CalculateCrc(pack + entry->offset, entry->size) == entry->checksum;
+
+    if (job->crc_ok && job->dst != NULL) {
+        uint64_t start = rdtsc();
+        INTN n = lz4_decompress(pack + entry->offset, entry->size, job->dst, entry->raw_size);
+        job->ticks = rdtsc() - start;
+        job->unpack_ok = n >= 0 && (UINTN)n == entry->raw_size;
+    }
+}
+
+
+/*
+ *  Checksums every entry and decompresses the LZ4 ones up front,
+ *  spread over all processors. Entries that fail are left for
+ *  fpack_slice() to report when they're asked for.
+ *
+ *  @stage: Timing stage the work is accounted to.
+ *
+ */
+
+void fpack_prepare(UINTN stage) {
+    static struct PrepareJob jobs[FPACK_MAX_ENTRIES];
+    static struct MpJob mp_jobs[FPACK_MAX_ENTRIES];
+    UINTN njobs = 0;
+    UINTN bytes = 0;
+
+    for (UINTN i = 0; i < nentries; ++i) {
+        struct FPackEntry* entry = &pack_index[i];
+
+        if (verified[i]) {
+            continue;
+        }
+
+        jobs[njobs].entry = entry;
+        jobs[njobs].dst = NULL;
+        jobs[njobs].ticks = 0;
+        jobs[njobs].crc_ok = FALSE;
+        jobs[njobs].unpack_ok = FALSE;
+
+        // The APs can't allocate, so output buffers come from here.
+        if (entry->flags & FPACK_FLAG_LZ4) {
+            EFI_PHYSICAL_ADDRESS addr;
+
+            if (!EFI_ERROR(BS->AllocatePages(AllocateAnyPages, EfiLoaderData, EFI_SIZE_TO_PAGES(entry->raw_size), &addr))) {
+                jobs[njobs].dst = (void*)addr;
+            }
+        }
+
+        mp_jobs[njobs].fn = prepare_entry;
+        mp_jobs[njobs].arg = &jobs[njobs];
+        bytes += entry->raw_size;
+        ++njobs;
+    }
+
+    if (njobs == 0) {
+        return;
+    }
+
+    uint64_t start = rdtsc();
+    struct MpRun run = mp_run(mp_jobs, njobs);
+    uint64_t elapsed = rdtsc() - start;
+
+    for (UINTN j = 0; j < njobs; ++j) {
+        struct FPackEntry* entry = jobs[j].entry;
+        UINTN i = entry - pack_index;
+        BOOLEAN lz4 = (entry->flags & FPACK_FLAG_LZ4) != 0;
+
+        verified[i] = jobs[j].crc_ok;
+
+        if (lz4 && jobs[j].unpack_ok) {
+            unpacked[i] = jobs[j].dst;
+            log_unpacked(entry, timing_ticks_to_us(jobs[j].ticks));
+        } else if (jobs[j].dst != NULL) {
+            BS->FreePages((EFI_PHYSICAL_ADDRESS)jobs[j].dst, EFI_SIZE_TO_PAGES(entry->raw_size));
+        }
+    }
+
+    // Serial stages keep work at 0, as BootStage documents.
+    if (run.ncpus > 1) {
+        timing_set_work(stage, run.work, run.ncpus);
+    }
+
+    uint64_t us = timing_ticks_to_us(elapsed);
+    uint64_t speedup = elapsed ? run.work * 100 / elapsed : 100;
+
+    log_info(L"Prepared %d entries (%d bytes) on %d CPUs in %d us (%d MB/s, %d.%02dx).\n",
+            njobs,
+            bytes,
+            run.ncpus,
+            us,
+            us ? bytes * 1000000 / us / (1024 * 1024) : 0,
+            speedup / 100,
+            speedup % 100);
+}
+
+
+/*
+ *  Returns the data of an entry, or NULL if its checksum is bad.
+ *  Compressed entries are decompressed the first time they're
+ *  handed out.
+ *
+ *  @i: Entry index.
+ *  @size: Set to the (decompressed) entry size.
+ *
+ */
+
+void* fpack_slice(UINTN i, UINTN* size) {
+    if (i >= nentries) {
+        return NULL;
+    }
+
+    struct FPackEntry* entry = &pack_index[i];
+
+    if (!verified[i]) {
+        if (CalculateCrc(pack + entry->offset, entry->size) != entry->checksum) {
+            log_error(L"Pack entry %a checksum mismatch!\n", entry->name);
+            return NULL;
+        }
+
+        verified[i] = TRUE;
+    }
+
+    *size = entry->raw_size;
+
+    if (!(entry->flags & FPACK_FLAG_LZ4)) {
+        return pack + entry->offset;
+    }
+
+    if (unpacked[i] == NULL) {
+        unpacked[i] = unpack_entry(entry);
+    }
+
+    return unpacked[i];
+}
+
+
+/*
+ *  Looks up an entry by name.
+ *
+ *  @name: Entry name, only ASCII names can match.
+ *  @size: Set to the entry size.
+ *
+ */
+
+void* fpack_find(CHAR16* name, UINTN* size) {
+    char ascii[FPACK_NAME_LEN];
+    UINTN len;
+
+    for (len = 0; name[len]; ++len) {
+        if (len == FPACK_NAME_LEN - 1 || name[len] > 0x7F) {
+            return NULL;
+        }
+
+        ascii[len] = (char)name[len];
+    }
+
+    ascii[len] = '\0';
+    uint32_t hash = fpack_hash(ascii);
+
+    for (UINTN i = 0; i < nentries; ++i) {
+        if (pack_index[i].name_hash == hash && strncmpa((CHAR8*)pack_index[i].name, (CHAR8*)ascii, FPACK_NAME_LEN) == 0) {
+            return fpack_slice(i, size);
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,380 @@
+/*
+ *  MIT License
+ *
+ *  Copyright (c) 2022 FacelessSociety, Ian Marco Moffett
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+
+#include <efi.h>
+#include <efilib.h>
+#include <common/fs_session.h>
+#include <config.h>
+#include <common/log.h>
+#include <common/timing.h>
+
+struct FsSession fsession;
+
+
+/*
+ *  Opens the root directory of the volume the loader was
+ *  started from.
+ *
+ *  @image_handle: Pass in image handle.
+ *  @st: Pass in system table.
+ *
+ */
+
+EFI_STATUS fs_session_open(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE* st) {
+    EFI_LOADED_IMAGE_PROTOCOL* loaded_image;
+    EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* sfsp;
+
+    if (fsession.root != NULL) {
+        return EFI_SUCCESS;
+    }
+
+    // Get the loaded image protocol.
+    EFI_STATUS s = st->BootServices->HandleProtocol(image_handle, &gEfiLoadedImageProtocolGuid, (void**)&loaded_image);
+
+    if (EFI_ERROR(s)) {
+        log_error(L"%a() failed: Failed to fetch loaded image protocol.\n", __func__);
+        return s;
+    }
+
+    // Get SFSP.
+    s = st->BootServices->HandleProtocol(loaded_image->DeviceHandle, &gEfiSimpleFileSystemProtocolGuid, (void**)&sfsp);
+
+    if (EFI_ERROR(s)) {
+        log_error(L"%a() failed: Failed to fetch EFI_SIMPLE_FILE_SYSTEM_PROTOCOL.\n", __func__);
+        return s;
+    }
+
+    // Open volume at root directory.
+    s = sfsp->OpenVolume(sfsp, &fsession.root);
+
+    if (EFI_ERROR(s)) {
+        log_error(L"%a() failed: Failed to open volume.\n", __func__);
+        fsession.root = NULL;
+        return s;
+    }
+
+    log_debug(L"Boot volume opened.\n");
+    return EFI_SUCCESS;
+}
+
+
+/*
+ *  Opens a file in the root directory for reading.
+ *
+ *  @path: Filepath for file in root directory.
+ *  @file: Set to the opened file.
+ *
+ */
+
+EFI_STATUS fs_session_open_file(CHAR16* path, EFI_FILE** file) {
+    if (fsession.root == NULL) {
+        return EFI_NOT_READY;
+    }
+
+    EFI_STATUS s = fsession.root->Open(fsession.root, file, path, EFI_FILE_MODE_READ, EFI_FILE_READ_ONLY);
+
+    if (EFI_ERROR(s)) {
+        return s;
+    }
+
+    // The first open pays for reaching root, every other one is saved.
+    if (fsession.files_opened++ > 0) {
+        fsession.calls_saved += FS_SESSION_ROOT_CALLS;
+    }
+
+    return EFI_SUCCESS;
+}
+
+
+void fs_session_close_file(EFI_FILE* file) {
+    if (file == NULL) {
+        return;
+    }
+
+    file->Close(file);
+    ++fsession.files_closed;
+}
+
+
+// Gets the size of an opened file.
+static EFI_STATUS get_file_size(EFI_FILE* file, UINTN* size) {
+    EFI_FILE_INFO* info = NULL;
+    UINTN info_size = 0;
+
+    EFI_STATUS s = file->GetInfo(file, &gEfiFileInfoGuid, &info_size, NULL);
+
+    if (s != EFI_BUFFER_TOO_SMALL) {
+        log_error(L"%a() failed: Failed to size file info.\n", __func__);
+        return s;
+    }
+
+    s = BS->AllocatePool(EfiLoaderData, info_size, (void**)&info);
+
+    if (EFI_ERROR(s)) {
+        return s;
+    }
+
+    s = file->GetInfo(file, &gEfiFileInfoGuid, &info_size, info);
+
+    if (EFI_ERROR(s)) {
+        log_error(L"%a() failed: Failed to fetch file info.\n", __func__);
+        BS->FreePool(info);
+        return s;
+    }
+
+    *size = info->FileSize;
+    BS->FreePool(info);
+    return EFI_SUCCESS;
+}
+
+
+/*
+ *  Opens a file and allocates a page aligned buffer for all of it.
+ *
+ *  @path: Filepath for file in root directory.
+ *  @rd: Read to set up.
+ *
+ */
+
+static EFI_STATUS read_setup(CHAR16* path, struct FsRead* rd) {
+    EFI_STATUS s = fs_session_open_file(path, &rd->file);
+
+    if (EFI_ERROR(s)) {
+        return s;
+    }
+
+    s = get_file_size(rd->file, &rd->size);
+
+    if (!EFI_ERROR(s)) {
+        s = BS->AllocatePages(AllocateAnyPages, EfiLoaderData, EFI_SIZE_TO_PAGES(rd->size), &rd->addr);
+
+        if (EFI_ERROR(s)) {
+            log_error(L"%a() failed: Failed to allocate %d pages.\n", __func__, EFI_SIZE_TO_PAGES(rd->size));
+        }
+    }
+
+    if (EFI_ERROR(s)) {
+        fs_session_close_file(rd->file);
+        rd->file = NULL;
+        return s;
+    }
+
+    rd->path = path;
+    rd->async = FALSE;
+    rd->end = 0;
+    return EFI_SUCCESS;
+}
+
+
+// Stamps an overlapped read's completion, so waiting late doesn't count.
+static VOID EFIAPI read_done(EFI_EVENT event, VOID* context) {
+    (void)event;
+    struct FsRead* rd = context;
+    rd->end = rdtsc();
+}
+
+
+// Waits out an overlapped read and closes its token event.
+static void read_wait(struct FsRead* rd) {
+    // Notify events can't be waited on, read_done() runs from the event dispatcher.
+    while (rd->end == 0) {
+        __asm__ __volatile__("pause");
+    }
+
+    BS->CloseEvent(rd->token.Event);
+}
+
+
+/*
+ *  Waits for (or does) the read of a set up file, then closes it.
+ *
+ *  @rd: Read set up by read_setup().
+ *
+ */
+
+static EFI_STATUS read_finish(struct FsRead* rd) {
+    EFI_STATUS s;
+    UINTN read_size;
+
+    if (rd->async) {
+        read_wait(rd);
+        s = rd->token.Status;
+        read_size = rd->token.BufferSize;
+    } else {
+        read_size = rd->size;
+        rd->start = rdtsc();
+        s = rd->file->Read(rd->file, &read_size, (void*)rd->addr);
+        rd->end = rdtsc();
+    }
+
+    uint64_t read_us = timing_ticks_to_us(rd->end - rd->start);
+    fs_session_close_file(rd->file);
+    rd->file = NULL;
+
+    if (EFI_ERROR(s) || read_size != rd->size) {
+        log_error(L"%a() failed: Single read of %d bytes failed.\n", __func__, rd->size);
+        BS->FreePages(rd->addr, EFI_SIZE_TO_PAGES(rd->size));
+        return EFI_ERROR(s) ? s : EFI_END_OF_FILE;
+    }
+
+    log_info(L"Read %s: %d bytes in %d us (%d MB/s)%s.\n",
+            rd->path,
+            rd->size,
+            read_us,
+            read_us ? rd->size * 1000000 / read_us / (1024 * 1024) : 0,
+            rd->async ? L", overlapped" : L"");
+
+    return EFI_SUCCESS;
+}
+
+
+/*
+ *  Starts reading a whole file in the background with ReadEx() so
+ *  the device works while the loader does something else. Falls
+ *  back to a plain Read() in fs_session_fetch() when the file
+ *  protocol has no ReadEx().
+ *
+ *  @path: Filepath for file in root directory.
+ *
+ */
+
+EFI_STATUS fs_session_prefetch(CHAR16* path) {
+    if (fsession.nreads == FS_SESSION_MAX_READS) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    struct FsRead* rd = &fsession.reads[fsession.nreads];
+    EFI_STATUS s = read_setup(path, rd);
+
+    if (EFI_ERROR(s)) {
+        return s;
+    }
+
+    ++fsession.nreads;
+
+#if FS_ASYNC_READS
+    if (rd->file->Revision < EFI_FILE_PROTOCOL_REVISION2) {
+        return EFI_SUCCESS;
+    }
+
+    if (EFI_ERROR(BS->CreateEvent(EVT_NOTIFY_SIGNAL, TPL_CALLBACK, read_done, rd, &rd->token.Event))) {
+        return EFI_SUCCESS;
+    }
+
+    rd->token.Status = EFI_SUCCESS;
+    rd->token.BufferSize = rd->size;
+    rd->token.Buffer = (void*)rd->addr;
+    rd->start = rdtsc();
+
+    if (EFI_ERROR(rd->file->ReadEx(rd->file, &rd->token))) {
+        BS->CloseEvent(rd->token.Event);
+        rd->end = 0;
+        return EFI_SUCCESS;
+    }
+
+    rd->async = TRUE;
+    ++fsession.async_reads;
+#endif
+
+    return EFI_SUCCESS;
+}
+
+
+/*
+ *  Returns a whole file in page aligned memory, picking up a
+ *  prefetched read when there is one.
+ *
+ *  @path: Filepath for file in root directory.
+ *  @buf: Set to the buffer, free with FreePages(EFI_SIZE_TO_PAGES(*size)).
+ *  @size: Set to the file size.
+ *
+ */
+
+EFI_STATUS fs_session_fetch(CHAR16* path, void** buf, UINTN* size) {
+    struct FsRead local;
+    struct FsRead* rd = NULL;
+    EFI_STATUS s;
+
+    for (UINTN i = 0; i < fsession.nreads; ++i) {
+        if (fsession.reads[i].file != NULL && StrCmp(fsession.reads[i].path, path) == 0) {
+            rd = &fsession.reads[i];
+            break;
+        }
+    }
+
+    if (rd == NULL) {
+        rd = &local;
+        s = read_setup(path, rd);
+
+        if (EFI_ERROR(s)) {
+            return s;
+        }
+    }
+
+    s = read_finish(rd);
+
+    if (EFI_ERROR(s)) {
+        return s;
+    }
+
+    *buf = (void*)rd->addr;
+    *size = rd->size;
+    return EFI_SUCCESS;
+}
+
+
+// Closes the root directory, must be done before ExitBootServices().
+void fs_session_close(void) {
+    if (fsession.root == NULL) {
+        return;
+    }
+
+    // Drop prefetched files nobody asked for.
+    for (UINTN i = 0; i < fsession.nreads; ++i) {
+        struct FsRead* rd = &fsession.reads[i];
+
+        if (rd->file == NULL) {
+            continue;
+        }
+
+        // ReadEx() may still be writing into the pages.
+        if (rd->async) {
+            read_wait(rd);
+        }
+
+        fs_session_close_file(rd->file);
+        BS->FreePages(rd->addr, EFI_SIZE_TO_PAGES(rd->size));
+        rd->file = NULL;
+    }
+
+    log_info(L"FS session: %d files opened, %d closed, %d overlapped reads, %d firmware calls saved.\n",
+            fsession.files_opened,
+            fsession.files_closed,
+            fsession.async_reads,
+            fsession.calls_saved);
+
+    fsession.root->Close(fsession.root);
+    fsession.root = NULL;
+}
@@ -0,0 +1,205 @@
+/*
+ *  MIT License
+ *
+ *  Copyright (c) 2022 FacelessSociety, Ian Marco Moffett
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+
+#include <efi.h>
+#include <efilib.h>
+#include <common/glyph.h>
+
+// A store op: row << 16 | column << 1 | wide (64-bit, two pixels).
+#define OP(row, col, wide) (((row) << 16) | ((col) << 1) | (wide))
+#define OP_ROW(op) ((op) >> 16)
+#define OP_COL(op) (((op) >> 1) & 0x7FFF)
+#define OP_WIDE(op) ((op) & 1)
+
+extern struct FacelessServices fs;
+
+
+/*
+ *  Every glyph is compiled once into the list of stores that draw
+ *  it: a 64-bit store per pair of set pixels, a 32-bit store for
+ *  lone ones. Drawing then never tests a bit, and since the list
+ *  doesn't depend on the colour one entry per glyph serves every
+ *  colour.
+ *
+ */
+
+static uint32_t* ops = NULL;
+static uint32_t* first_op = NULL;
+static uint32_t nglyphs = 0;
+static uint8_t* glyphs = NULL;
+static uint32_t width = 0;
+static uint32_t height = 0;
+static uint32_t row_bytes = 0;
+static uint32_t glyph_bytes = 0;
+
+
+static inline BOOLEAN pixel_set(const uint8_t* row, uint32_t col) {
+    return col < width && (row[col >> 3] & (0x80 >> (col & 7)));
+}
+
+
+// Writes the ops for one glyph row to @out (if not NULL), returns how many.
+static uint32_t compile_row(uint32_t* out, uint32_t row, const uint8_t* bits) {
+    uint32_t n = 0;
+
+    for (uint32_t col = 0; col < width; col += 2) {
+        BOOLEAN left = pixel_set(bits, col), right = pixel_set(bits, col + 1);
+        uint32_t op;
+
+        if (left && right) {
+            op = OP(row, col, 1);
+        } else if (left) {
+            op = OP(row, col, 0);
+        } else if (right) {
+            op = OP(row, col + 1, 0);
+        } else {
+            continue;
+        }
+
+        if (out != NULL) {
+            out[n] = op;
+        }
+
+        ++n;
+    }
+
+    return n;
+}
+
+
+// Compiles every glyph into @out (if not NULL), returns how many ops.
+static uint32_t compile_all(uint32_t* out) {
+    uint32_t total = 0;
+
+    for (uint32_t g = 0; g < nglyphs; ++g) {
+        const uint8_t* bitmap = glyphs + g * glyph_bytes;
+
+        if (out != NULL) {
+            first_op[g] = total;
+        }
+
+        for (uint32_t row = 0; row < height; ++row, bitmap += row_bytes) {
+            total += compile_row(out != NULL ? out + total : NULL, row, bitmap);
+        }
+    }
+
+    if (out != NULL) {
+        first_op[nglyphs] = total;
+    }
+
+    return total;
+}
+
+
+/*
+ *  Compiles every glyph of a PSF font. Runs while boot services
+ *  are up, glyph_draw() runs from the kernel too and only uses
+ *  what this leaves behind.
+ *
+ *  @font: Font filled in by font_parse().
+ *
+ */
+
+void glyph_cache_init(struct PSFont* font) {
+    nglyphs = font->nglyphs;
+    glyphs = font->glyph_buf;
+    width = font->width;
+    height = font->height;
+    row_bytes = font->bytes_per_row;
+    glyph_bytes = font->bytes_per_glyph;
+
+    uint32_t total = compile_all(NULL);
+
+    if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, (nglyphs + 1) * sizeof(uint32_t), (void**)&first_op))) {
+        nglyphs = 0;
+        return;
+    }
+
+    if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, (total ? total : 1) * sizeof(uint32_t), (void**)&ops))) {
+        FreePool(first_op);
+        nglyphs = 0;
+        return;
+    }
+
+    compile_all(ops);
+}
+
+
+// Glyph width in pixels, 0 before a font is loaded.
+uint32_t glyph_width(void) {
+    return nglyphs ? width : 0;
+}
+
+
+// Glyph height in pixel rows, 0 before a font is loaded.
+uint32_t glyph_height(void) {
+    return nglyphs ? height : 0;
+}
+
+
+// Bytes per glyph row in glyph_bitmap().
+uint32_t glyph_row_bytes(void) {
+    return row_bytes;
+}
+
+
+// Returns the row bitmaps of a glyph, glyph_row_bytes() per row, or NULL.
+const uint8_t* glyph_bitmap(uint32_t glyph) {
+    return glyph < nglyphs ? glyphs + glyph * glyph_bytes : NULL;
+}
+
+
+/*
+ *  Draws a glyph with a transparent background. Unset pixels are
+ *  left alone and the destination is never read.
+ *
+ *  @color: Pixel value for set bits.
+ *  @glyph: Glyph index, out of range glyphs draw nothing.
+ *  @x: Left pixel column.
+ *  @y: Top pixel row.
+ *  @framebuffer: Framebuffer or backbuffer, ppsl pixels per row.
+ *
+ */
+
+void glyph_draw(uint32_t color, uint32_t glyph, unsigned int x, unsigned int y, uint32_t* framebuffer) {
+    if (glyph >= nglyphs) {
+        return;
+    }
+
+    uint64_t pair = ((uint64_t)color << 32) | color;
+    uint64_t ppsl = fs.framebuffer.ppsl;
+    uint32_t* origin = framebuffer + y * ppsl + x;
+
+    for (uint32_t i = first_op[glyph]; i < first_op[glyph + 1]; ++i) {
+        uint32_t op = ops[i];
+        uint32_t* dst = origin + OP_ROW(op) * ppsl + OP_COL(op);
+
+        if (OP_WIDE(op)) {
+            *(uint64_t*)dst = pair;
+        } else {
+            *dst = color;
+        }
+    }
+}
@@ -0,0 +1,92 @@
+/*
+ *  MIT License
+ *
+ *  Copyright (c) 2022 FacelessSociety, Ian Marco Moffett
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+
+#include <efi.h>
+#include <efilib.h>
+#include <common/services.h>
+#include <common/log.h>
+
+// Longest single message, longer ones are truncated.
+#define LOG_LINE_MAX 256
+
+extern struct FacelessServices fs;
+
+
+// Allocates the boot log ring, messages before this only reach the console.
+void log_init(void) {
+    char* buffer;
+
+    fs.log.buffer = NULL;
+    fs.log.size = 0;
+    fs.log.head = 0;
+
+    if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, LOG_RING_SIZE, (void**)&buffer))) {
+        return;
+    }
+
+    fs.log.buffer = buffer;
+    fs.log.size = LOG_RING_SIZE;
+}
+
+
+// Appends ASCII text to the ring, dropping the oldest bytes when full.
+static void ring_write(const CHAR16* str) {
+    if (fs.log.buffer == NULL) {
+        return;
+    }
+
+    for (; *str; ++str) {
+        // Console line endings are \r\n, the ring only keeps \n.
+        if (*str == '\r') {
+            continue;
+        }
+
+        fs.log.buffer[fs.log.head++ % fs.log.size] = *str < 0x80 ? (char)*str : '?';
+    }
+}
+
+
+/*
+ *  Formats a message with the Print() format rules and logs it.
+ *
+ *  @level: LOG_LEVEL_*.
+ *  @fmt: Format string.
+ *
+ */
+
+void log_write(UINTN level, CONST CHAR16* fmt, ...) {
+    CHAR16 line[LOG_LINE_MAX];
+    va_list args;
+
+    va_start(args, fmt);
+    VSPrint(line, sizeof(line), fmt, args);
+    va_end(args);
+
+    ring_write(line);
+
+    if (level <= LOG_CONSOLE_LEVEL) {
+        ST->ConOut->OutputString(ST->ConOut, line);
+    }
+}
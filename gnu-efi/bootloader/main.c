@@ -28,16 +28,30 @@
 #include <elf.h>
 #include <stddef.h>
 #include <common/services.h>
+#include <common/memmap.h>
+#include <common/mp.h>
+#include <common/paging.h>
+#include <common/timing.h>
+#include <common/fs_session.h>
+#include <common/fpack.h>
+#include <common/compositor.h>
+#include <common/glyph.h>
+#include <common/font.h>
+#include <common/text.h>
+#include <common/surface.h>
+#include <common/console.h>
+#include <common/firmware.h>
+#include <common/acpi.h>
+#include <common/smbios_index.h>
+#include <common/pci.h>
+#include <common/cpuinfo.h>
+#include <common/log.h>
 #include <config.h>
 
 // 2022 Ian Moffett
 
 
-#define PSF1_MAGIC0 0x00000036
-#define PSF1_MAGIC1 0x00000004
-
 struct FacelessServices fs;
-UINTN mmap_key;
 
 
 // Shutsdown the system.
@@ -65,10 +79,11 @@ EFI_MEMORY_DESCRIPTOR* mmap_iterator_helper(uint64_t i, struct MemoryMap mmap) {
  */
 
 void fatal(void) {
-    Print(L"System halted. Upon pressing a key, the system will shutdown.");
+    log_error(L"System halted. Upon pressing a key, the system will shutdown.");
     EFI_INPUT_KEY tmp;
 
-    while (ST->ConIn->ReadKeyStroke(ST->ConIn, &tmp) == EFI_NOT_READY);
+    WaitForSingleEvent(ST->ConIn->WaitForKey, 0);
+    ST->ConIn->ReadKeyStroke(ST->ConIn, &tmp);
     shutdown();
 }
 
@@ -87,19 +102,20 @@ int memcmp(const void* aptr, const void* bptr, size_t n) {
 /*
  *  This sets up Graphics Output Protocol (GOP).
  *
- *  @st: System Table.
+ *  Without a backbuffer, backbuffer, flush and damage stay
+ *  NULL and everything is drawn straight to the framebuffer.
  *
  */
 
 
-void init_gop(EFI_SYSTEM_TABLE* st) {
+void init_gop(void) {
     EFI_GUID gop_guid = EFI_GRAPHICS_OUTPUT_PROTOCOL_GUID;
     EFI_GRAPHICS_OUTPUT_PROTOCOL* gop;
-    Print(L"Locating Graphics Output Protocol..\n");
+    log_debug(L"Locating Graphics Output Protocol..\n");
     EFI_STATUS s = uefi_call_wrapper(BS->LocateProtocol, 3, &gop_guid, NULL, (void**)&gop);
 
     if (EFI_ERROR(s)) {
-        Print(L"%s() FAILED!: FAILED TO LOCATE GOP.\n", __func__);
+        log_error(L"%a() FAILED!: FAILED TO LOCATE GOP.\n", __func__);
         fatal();
     }
 
@@ -109,12 +125,22 @@ void init_gop(EFI_SYSTEM_TABLE* st) {
     fs.framebuffer.width = gop->Mode->Info->HorizontalResolution;
     fs.framebuffer.height = gop->Mode->Info->VerticalResolution;
     fs.framebuffer.ppsl = gop->Mode->Info->PixelsPerScanLine;
-    
-    Print(L"Allocating memory for backbuffer..\n");
-    st->BootServices->AllocatePool(EfiLoaderData, fs.framebuffer.buffer_size, (void**)&fs.framebuffer.backbuffer);
+    surface_set_format(gop->Mode->Info);
+
+    log_debug(L"Allocating memory for backbuffer..\n");
+    if (EFI_ERROR(compositor_init())) {
+        log_error(L"No backbuffer, drawing straight to the framebuffer.\n");
+        fs.framebuffer.flush = NULL;
+        fs.framebuffer.damage = NULL;
+    } else {
+        fs.framebuffer.flush = framebuf_flush;
+        fs.framebuffer.damage = framebuf_damage;
+    }
+
+    console_init();
 
     // Dump framebuffer info.
-    Print(
+    log_debug(
             L"FRAMEBUFFER BASE: 0x%X\n"
             L"FRAMEBUFFER SIZE: %d\n"
             L"FRAMEBUFFER WIDTH: %d\n"
@@ -131,219 +157,239 @@ void init_gop(EFI_SYSTEM_TABLE* st) {
 
 
 /*
+ *  Opens a file through the boot volume session.
+ *
  *  @path: Filepath for file in root directory.
- *  @imageHandle: Pass in image handle.
- *  @st: Pass in system table.
  *
+ *  Close the result with fs_session_close_file().
  *
  */
 
-EFI_FILE* load_file(CHAR16* path, EFI_HANDLE imageHandle, EFI_SYSTEM_TABLE* st) {
+EFI_FILE* load_file(CHAR16* path) {
     EFI_FILE* res;
-    EFI_LOADED_IMAGE_PROTOCOL* loadedImage;
 
-    Print(L"Loading %s.. If the system hangs, you may want to check this file.\n", path);
-
-    Print(L"Fetching loaded image protocol..\n");
-    // Get the loaded image protocol.
-    st->BootServices->HandleProtocol(imageHandle, &gEfiLoadedImageProtocolGuid, (void**)&loadedImage);
-    Print(L"Loaded image protocol fetched!\n");
-
-    // Get SFSP.
-    EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* fs;
-    Print(L"Fetching EFI_SIMPLE_FILE_SYSTEM_PROTOCOL..\n");
-    st->BootServices->HandleProtocol(loadedImage->DeviceHandle, &gEfiSimpleFileSystemProtocolGuid, (void**)&fs);
-    Print(L"EFI_SIMPLE_FILE_SYSTEM_PROTOCOL fetched!\n");
-
-    // Open volume at root directory.
-    EFI_FILE* dir = NULL;
-    fs->OpenVolume(fs, &dir);
-    Print(L"Volume opened.\n");
-
-    EFI_STATUS s = dir->Open(dir, &res, path, EFI_FILE_MODE_READ, EFI_FILE_READ_ONLY);
-    Print(L"Directory opened.\n");
-    Print(L"File fetched: %s\n\n", path);
+    log_debug(L"Loading %s.. If the system hangs, you may want to check this file.\n", path);
+    EFI_STATUS s = fs_session_open_file(path, &res);
+    log_debug(L"File fetched: %s\n\n", path);
 
     if (s != EFI_SUCCESS) {
-        Print(L"<s!=EFI_SUCCESS@%d>\n", __LINE__);
+        log_error(L"<s!=EFI_SUCCESS@%d>\n", __LINE__);
         fatal();
     }
     return res;
 }
 
 
-void load_font(EFI_HANDLE imageHandle, EFI_SYSTEM_TABLE* st) {
-    // Load the font.
-    EFI_FILE* font = load_file(PSF1_FONT_PATH, imageHandle, st);
+/*
+ *  Starts reads of every file the loader will need, the boot pack
+ *  if there is one, otherwise the loose font, BMPs and kernel.
+ *
+ */
 
-    if (!(font)) {
-        Print(L"%s() failed: Failed to load font.\n", __func__);
-        fatal();
+void prefetch_assets(void) {
+    if (!EFI_ERROR(fs_session_prefetch(FPACK_PATH))) {
+        return;
     }
 
-    Print(L"Allocating %d bytes of memory for PSFont header..\n", sizeof(struct PSFontHeader));
-    struct PSFontHeader* header;
+    fs_session_prefetch(FONT_PATH);
 
-    // Allocate memory for the header.
-    st->BootServices->AllocatePool(EfiLoaderData, sizeof(struct PSFontHeader), (void**)&header);
+    for (int i = 0; i < MAX_BMP_IMPORTS; ++i) {
+        fs_session_prefetch(bmp_imports[i]);
+    }
 
-    // Load font into buffer.
-    UINTN size = sizeof(struct PSFontHeader);
-    Print(L"Loading %d bytes into memory from font.\n", size);
-    font->Read(font, &size, header);
+#if KERNEL_LOAD_IN_MEMORY
+    fs_session_prefetch(KERNEL_PATH);
+#endif
+}
 
-    if (!(header->magic[0] & PSF1_MAGIC0) || !(header->magic[1] & PSF1_MAGIC1)) {
-        Print(L"%d() failed!: PSFontHeader magic invalid!", __func__);
-        fatal();
-    }
 
-    UINTN glyph_buffer_size = header->chsize * 256;
+/*
+ *  Fetches a boot asset, out of the boot pack when one is loaded,
+ *  otherwise by reading (or picking up the prefetch of) its own file.
+ *
+ *  @path: Asset name/filepath in root directory.
+ *  @size: Set to the asset size.
+ *
+ */
+
+void* load_asset(CHAR16* path, UINTN* size) {
+    void* data;
+
+    if (fpack_loaded()) {
+        data = fpack_find(path, size);
+
+        if (data != NULL) {
+            return data;
+        }
+
+        log_info(L"%s not in boot pack, trying the file..\n", path);
+    }
 
-    if (header->mode == 1) {
-        glyph_buffer_size = header->chsize * 512;
+    if (EFI_ERROR(fs_session_fetch(path, &data, size))) {
+        log_error(L"Failed to read %s!\n", path);
+        fatal();
     }
 
-    // Load font data.
-    void* glyph_buf;
+    return data;
+}
 
-    // Set position to end of header.
-    font->SetPosition(font, sizeof(struct PSFontHeader));
 
-    // Allocate memory for glyph buffer.
-    Print(L"Allocating %d bytes of memory for font glyph buffer..\n");
-    st->BootServices->AllocatePool(EfiLoaderData, glyph_buffer_size, (void**)&glyph_buf);
-    Print(L"Loading font data into memory..\n");
-    font->Read(font, &glyph_buffer_size, glyph_buf);
+void load_font(EFI_SYSTEM_TABLE* st) {
+    // Load the font.
+    UINTN size;
+    uint8_t* font = load_asset(FONT_PATH, &size);
 
     struct PSFont* fontres;
-    st->BootServices->AllocatePool(EfiLoaderData, sizeof(struct PSFont), (void**)&fontres);
-    fontres->header = header;
-    fontres->glyph_buf = glyph_buf;
-    fs.psfont = fontres;
 
+    if (EFI_ERROR(st->BootServices->AllocatePool(EfiLoaderData, sizeof(struct PSFont), (void**)&fontres))) {
+        log_error(L"%a() failed: Out of memory.\n", __func__);
+        fatal();
+    }
+
+    if (EFI_ERROR(font_parse(font, size, fontres))) {
+        log_error(L"%a() failed!: Font is invalid!\n", __func__);
+        fatal();
+    }
 
+    fs.psfont = fontres;
+    glyph_cache_init(fontres);
 }
 
 
 // Places a character on the screen.
 void putChar(uint32_t color, char chr, unsigned int xOff, unsigned int yOff, uint32_t* framebuffer) {
-    char* fontPtr = fs.psfont->glyph_buf + (chr * fs.psfont->header->chsize);
-    for (unsigned long y = yOff; y < yOff + 16; y++){
-        for (unsigned long x = xOff; x < xOff+8; x++){
-        if ((*fontPtr & (0b10000000 >> (x - xOff))) > 0){
-            *(unsigned int*)(framebuffer + x + (y * fs.framebuffer.ppsl)) = color;
-        }
-
-        }
-        fontPtr++;
-    }
+    glyph_draw(color, font_lookup((uint8_t)chr), xOff, yOff, framebuffer);
+    compositor_track(framebuffer, xOff, yOff, glyph_width(), glyph_height());
 }
 
 
-void load_all_bmps(EFI_HANDLE imageHandle, EFI_SYSTEM_TABLE* sysTable) {
-    for (int i = 0; i < MAX_BMP_IMPORTS; ++i) {
-        EFI_FILE* bmp_file = load_file(bmp_imports[i], imageHandle, sysTable);
-
-        // This tmp will be to get the file size.
-        struct BMP tmp;
-        UINTN tmp_readsz = sizeof(tmp.header);
-
-        Print(L"Reading BMP header into memory..\n");
-        bmp_file->Read(bmp_file, &tmp_readsz, &tmp.header);
+// Places a glyph, by index, on the screen.
+void putGlyph(uint32_t color, uint32_t glyph, unsigned int xOff, unsigned int yOff, uint32_t* framebuffer) {
+    glyph_draw(color, glyph, xOff, yOff, framebuffer);
+    compositor_track(framebuffer, xOff, yOff, glyph_width(), glyph_height());
+}
 
-        Print(L"Checking BMP header signature..\n");
-        if ((tmp.header.signature & 0xFF) != 'B' || (tmp.header.signature >> 8) != 'M') {
-            Print(L"BMP header signature invalid!\n");
-            fatal();
-        }
 
-        Print(L"BMP signature is valid!\n");
+/*
+ *  Checks a BMP and puts it in a FacelessServices slot.
+ *
+ *  @bmp: Whole BMP file.
+ *  @size: Size of the BMP file.
+ *  @slot: Index into fs.bmps.
+ *
+ */
 
-        struct BMP* bmp = NULL;
-        
-        // Allocate memory for the entire BMP.
-        Print(L"Allocating %d needed for BMP.\n", tmp.header.file_size);
-        UINTN bmp_sz = tmp.header.file_size;
-        EFI_STATUS s = sysTable->BootServices->AllocatePool(EfiLoaderData, bmp_sz, (void**)&bmp);
+void add_bmp(struct BMP* bmp, UINTN size, UINTN slot) {
+    log_debug(L"Checking BMP header signature..\n");
+    if (size < sizeof(bmp->header) ||
+            (bmp->header.signature & 0xFF) != 'B' || (bmp->header.signature >> 8) != 'M') {
+        log_error(L"BMP header signature invalid!\n");
+        fatal();
+    }
 
-        if (bmp == NULL || s != EFI_SUCCESS) {
-            Print(L"Failed to load one of the BMPs: ALLOC_POOL_FAILED\n");
-            fatal();
-        }
+    if (bmp->header.file_size > size) {
+        log_error(L"BMP is truncated!\n");
+        fatal();
+    }
 
-        // Load that memory chunk.
-        Print(L"Loading allocated memory with BMP.\n");
-        bmp_file->Read(bmp_file, &bmp_sz, bmp);
-        Print(L"Finished loading BMP into memory! Filling FacelessServices slot..\n");
+    log_debug(L"BMP signature is valid!\n");
 
-        // Fill BMPS slot.
-        fs.bmps[i] = bmp;
-        Print(L"Slot filled!\n");
-    }
+    // Fill BMPS slot.
+    fs.bmps[slot] = bmp;
+    log_debug(L"Slot filled!\n");
 }
 
 
-/*
- *  Fetches the Root System Description Pointer.
- *  
- *  @st: System Table.
- *
- */
+// Returns TRUE if @name ends with ".bmp".
+static BOOLEAN is_bmp_name(const char* name) {
+    UINTN len = strlena((CHAR8*)name);
+    return len >= 4 && strcmpa((CHAR8*)name + len - 4, (CHAR8*)".bmp") == 0;
+}
 
-void* get_rsdp(EFI_SYSTEM_TABLE* st) {
-    EFI_CONFIGURATION_TABLE* config_table = st->ConfigurationTable;
-    EFI_GUID rsdp_guid = ACPI_20_TABLE_GUID;
-    void* rsdp = NULL;
 
-    for (UINTN i = 0; i < st->NumberOfTableEntries; ++i) {
-        if (CompareGuid(&config_table[i].VendorGuid, &rsdp_guid)) {
-            if (memcmp((char*)"RSD PTR ", (char*)config_table->VendorTable, 8) == 0) {
-                rsdp = (void*)config_table->VendorTable;
-                break;
-            }
+void load_all_bmps(void) {
+    if (!fpack_loaded()) {
+        for (int i = 0; i < MAX_BMP_IMPORTS; ++i) {
+            UINTN size;
+            struct BMP* bmp = load_asset(bmp_imports[i], &size);
+            add_bmp(bmp, size, i);
         }
 
-        ++config_table;
+        return;
     }
 
-    return rsdp;
-}
+    // Every BMP in the pack, in pack order.
+    UINTN slot = 0;
 
+    for (UINTN i = 0; i < fpack_count() && slot < MAX_BMP_IMPORTS; ++i) {
+        struct FPackEntry* entry = fpack_entry(i);
 
-// Sets stuff for runtime.
-void setup_services(EFI_SYSTEM_TABLE* sysTable) {
-    fs.power.shutdown = shutdown;
+        if (!is_bmp_name(entry->name)) {
+            continue;
+        }
 
-    // Setup memory map.
-    EFI_MEMORY_DESCRIPTOR* map = NULL;
-    UINTN map_size, descriptor_size;
-    UINT32 descriptor_version;
+        UINTN size;
+        struct BMP* bmp = fpack_slice(i, &size);
 
-    Print(L"Fetching memory map..\n");
-    sysTable->BootServices->GetMemoryMap(&map_size, map, &mmap_key, &descriptor_size, &descriptor_version);
-    sysTable->BootServices->AllocatePool(EfiLoaderData, map_size, (void**)&map);
-    sysTable->BootServices->GetMemoryMap(&map_size, map, &mmap_key, &descriptor_size, &descriptor_version);
-    EFI_STATUS s = sysTable->BootServices->GetMemoryMap(&map_size, map, &mmap_key, &descriptor_size, &descriptor_version);
+        if (bmp == NULL) {
+            fatal();
+        }
 
-    if (s != EFI_SUCCESS) { 
-        Print(L"FATAL: GetMemoryMap returned a non-zero value. <bug@%d>\n", __LINE__);
-        fatal();
+        add_bmp(bmp, size, slot++);
     }
+}
 
-    Print(L"Memory map fetched.\n");
 
-    // Set the Faceless Services table entries.
-    fs.mmap.mMap = map;
-    fs.mmap.mSize = map_size;
-    fs.mmap.mDescriptorSize = descriptor_size;
+// Sets stuff for runtime.
+void setup_services(EFI_SYSTEM_TABLE* sysTable) {
+    fs.power.shutdown = shutdown;
 
     // Setup memory map services.
     fs.mmap_get_entries = get_mmap_entries;
     fs.mmap_iterator_helper = mmap_iterator_helper;
     fs.framebuf_putch = putChar;
+    fs.framebuf_write_span = framebuf_write_span;
+    fs.framebuf_puts = framebuf_puts;
+    fs.console_write = console_write;
+    fs.console_clear = console_clear;
+    fs.font_lookup = font_lookup;
+    fs.framebuf_putglyph = putGlyph;
+    fs.acpi_find = acpi_find;
+    fs.smbios_find = smbios_find;
+    fs.smbios_string = smbios_string;
     
-    Print(L"Fetching Root System Description Pointer..\n");
-    fs.rsdp = get_rsdp(sysTable);
+    log_debug(L"Indexing firmware configuration tables..\n");
+    firmware_index_tables(sysTable);
+    acpi_index_tables();
+    smbios_index_tables();
+}
+
+
+/*
+ *  Returns the boot policy, BOOT_POLICY unless the
+ *  FacelessBootPolicy variable overrides it.
+ *
+ *  @timeout: Set to the timeout in seconds.
+ *
+ */
+
+UINT32 get_boot_policy(UINT32* timeout) {
+    EFI_GUID guid = FACELESS_LOADER_VARIABLE_GUID;
+    UINT32 var[2];
+    UINTN size = sizeof(var);
+
+    *timeout = BOOT_TIMEOUT_SECONDS;
+    EFI_STATUS s = RT->GetVariable(BOOT_POLICY_VARIABLE, &guid, NULL, &size, var);
+
+    if (EFI_ERROR(s) || size < sizeof(UINT32) || var[0] > BOOT_POLICY_WAIT_KEY) {
+        return BOOT_POLICY;
+    }
+
+    if (size >= sizeof(var)) {
+        *timeout = var[1];
+    }
+
+    return var[0];
 }
 
 
@@ -351,7 +397,7 @@ void setup_services(EFI_SYSTEM_TABLE* sysTable) {
 void greet(void) {
     EFI_TIME time;
     RT->GetTime(&time, NULL);
-    Print(
+    log_info(
             L"Welcome, Friend. Today Is: %d/%d/%d %d:%d:%d\n",
             time.Month,
             time.Day,
@@ -360,85 +406,265 @@ void greet(void) {
             time.Minute,
             time.Second);
 
-    Print(L"Press any key to boot.\n");
-
+    UINT32 timeout;
     EFI_INPUT_KEY tmp;
-    while (ST->ConIn->ReadKeyStroke(ST->ConIn, &tmp) == EFI_NOT_READY);
+
+    // Every wait below sleeps on the key event so the firmware can idle.
+    switch (get_boot_policy(&timeout)) {
+        case BOOT_POLICY_IMMEDIATE:
+            break;
+        case BOOT_POLICY_TIMEOUT:
+            if (timeout > 0) {
+                EFI_INPUT_KEY timeout_key = { 0, 0 };
+                WaitForEventWithTimeout(
+                        ST->ConIn->WaitForKey,
+                        timeout,
+                        ST->ConOut->Mode->CursorRow,
+                        ST->ConOut->Mode->CursorColumn,
+                        L"Booting in %d second(s), press any key to boot now. ",
+                        timeout_key,
+                        &tmp);
+
+                Print(L"\n");
+            }
+            break;
+        default:
+            Print(L"Press any key to boot.\n");
+            WaitForSingleEvent(ST->ConIn->WaitForKey, 0);
+            ST->ConIn->ReadKeyStroke(ST->ConIn, &tmp);
+            break;
+    }
 }
 
 
-void boot(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE* st) {
-    // Get the kernel file.
-    EFI_FILE* kernel = load_file(L"kernel.elf", image_handle, st);
+// Halts if @header isn't an x86_64 executable ELF64 header with full-size program headers.
+void verify_kernel_header(Elf64_Ehdr* header) {
+    log_debug(L"Verifying kernel ELF header..\n");
+    if (memcmp(&header->e_ident[EI_MAG0], ELFMAG, SELFMAG) != 0 ||
+            header->e_ident[EI_CLASS] != ELFCLASS64 || 
+            header->e_type != ET_EXEC ||
+            header->e_machine != EM_X86_64 ||
+            header->e_version != EV_CURRENT ||
+            header->e_phentsize < sizeof(Elf64_Phdr)) {
+        // -------------------------------
 
-    Elf64_Ehdr header;
-    UINTN file_info_size;
+        log_error(L"Kernel ELF header bad!\n");
+        fatal();
+    }
 
-    // Get kernel info.
-    kernel->GetInfo(kernel, &gEfiFileInfoGuid, &file_info_size, NULL);
+    log_debug(L"Kernel ELF header verified!\n");
+}
 
-    // Read kernel header into memory.
-    Print(L"Reading in kernel ELF header.\n");
-    UINTN size = sizeof(header);
-    kernel->Read(kernel, &size, &header);
 
-    Print(L"Verifying kernel ELF header..\n");
-    if (memcmp(&header.e_ident[EI_MAG0], ELFMAG, SELFMAG) != 0 ||
-            header.e_ident[EI_CLASS] != ELFCLASS64 || 
-            header.e_type != ET_EXEC ||
-            header.e_machine != EM_X86_64 ||
-            header.e_version != EV_CURRENT) {
-        // -------------------------------
+/*
+ *  Loads the kernel with a seek and read per ELF structure.
+ *
+ *  @kernel: Opened kernel file.
+ *  @st: System Table.
+ *
+ *  Returns the kernel entry point.
+ *
+ */
 
-        Print(L"Kernel ELF header bad!\n");
-        fatal();
-    }
+Elf64_Addr load_kernel_streamed(EFI_FILE* kernel, EFI_SYSTEM_TABLE* st) {
+    Elf64_Ehdr header;
 
-    Print(L"Kernel ELF header verified!\n");
+    // Read kernel header into memory.
+    UINTN stage = timing_begin("boot.ehdr");
+    log_debug(L"Reading in kernel ELF header.\n");
+    UINTN size = sizeof(header);
+    kernel->Read(kernel, &size, &header);
+    verify_kernel_header(&header);
+    timing_end(stage);
 
     // Setup program header(s).
+    stage = timing_begin("boot.phdrs");
     Elf64_Phdr* program_headers;
     kernel->SetPosition(kernel, header.e_phoff);
 
     // This is basically saying we added header.e_phoff to the file
     // pointer base.
-    Print(L"Kernel FP_BASE_OFFSET => header.e_phoff\n");
+    log_debug(L"Kernel FP_BASE_OFFSET => header.e_phoff\n");
 
     
-    UINTN program_header_size = header.e_phnum * header.e_phentsize;
+    UINTN program_header_size = (UINTN)header.e_phnum * header.e_phentsize;
     // Allocate memory for program header(s).
     st->BootServices->AllocatePool(EfiLoaderData, program_header_size, (void**)&program_headers);
-    Print(L"Memory allocated for program headers.\n");
+    log_debug(L"Memory allocated for program headers.\n");
     
     // Read in the program header(s)!
     kernel->Read(kernel, &program_header_size, program_headers);
+    timing_end(stage);
 
     // Set everything up now!
+    stage = timing_begin("boot.segments");
 
     for (Elf64_Phdr* phdr = program_headers; (char*)phdr < (char*)program_headers + header.e_phnum * header.e_phentsize; phdr = (Elf64_Phdr*)((char*)phdr + header.e_phentsize)) {
         if (phdr->p_type == PT_LOAD) {
             int pages = (phdr->p_memsz + 0x1000 - 1) / 0x1000;
-            Print(L"phdr->p_type == PT_LOAD\n");
+            log_debug(L"phdr->p_type == PT_LOAD\n");
             Elf64_Addr segment = phdr->p_paddr;
-            Print(L"Segment fetched from program headers.\n");
-            st->BootServices->AllocatePages(AllocateAddress, EfiLoaderData, pages, &segment);
-            Print(L"Allocated some pages for ELF load segment.\n");
+            log_debug(L"Segment fetched from program headers.\n");
+
+            if (EFI_ERROR(st->BootServices->AllocatePages(AllocateAddress, EfiLoaderData, pages, &segment))) {
+                log_error(L"Can't allocate kernel segment at 0x%lx!\n", phdr->p_paddr);
+                fatal();
+            }
+
+            log_debug(L"Allocated some pages for ELF load segment.\n");
             kernel->SetPosition(kernel, phdr->p_offset);
-            Print(L"FP offset set to program offset.\n");
+            log_debug(L"FP offset set to program offset.\n");
             UINTN size = phdr->p_filesz;
             kernel->Read(kernel, &size, (void*)segment);
-            Print(L"Program read into memory.\n");
+            log_debug(L"Program read into memory.\n");
+            paging_add_segment(phdr->p_vaddr, phdr->p_paddr, phdr->p_memsz);
         }
     }
 
+    timing_end(stage);
+    return header.e_entry;
+}
+
+
+/*
+ *  Loads the kernel from an in-memory ELF image, parsing headers
+ *  and copying PT_LOAD segments out of @image.
+ *
+ *  @image: Whole kernel.elf image.
+ *  @image_size: Size of @image.
+ *  @st: System Table.
+ *
+ *  Returns the kernel entry point.
+ *
+ */
+
+Elf64_Addr load_kernel_image(uint8_t* image, UINTN image_size, EFI_SYSTEM_TABLE* st) {
+    // Parse headers straight out of the image.
+    UINTN stage = timing_begin("boot.parse");
+
+    if (image_size < sizeof(Elf64_Ehdr)) {
+        log_error(L"Kernel image too small!\n");
+        fatal();
+    }
+
+    Elf64_Ehdr* header = (Elf64_Ehdr*)image;
+    verify_kernel_header(header);
+
+    UINTN program_header_size = (UINTN)header->e_phnum * header->e_phentsize;
+
+    if (header->e_phoff > image_size || program_header_size > image_size - header->e_phoff) {
+        log_error(L"Kernel program headers out of bounds!\n");
+        fatal();
+    }
+
+    timing_end(stage);
+
+    stage = timing_begin("boot.segments");
+    uint8_t* program_headers = image + header->e_phoff;
+
+    for (uint8_t* p = program_headers; p < program_headers + program_header_size; p += header->e_phentsize) {
+        Elf64_Phdr* phdr = (Elf64_Phdr*)p;
+
+        if (phdr->p_type != PT_LOAD) {
+            continue;
+        }
+
+        if (phdr->p_offset > image_size || phdr->p_filesz > image_size - phdr->p_offset ||
+                phdr->p_filesz > phdr->p_memsz) {
+            log_error(L"Kernel PT_LOAD segment out of bounds!\n");
+            fatal();
+        }
+
+        UINTN pages = (phdr->p_memsz + 0x1000 - 1) / 0x1000;
+        Elf64_Addr segment = phdr->p_paddr;
+
+        if (EFI_ERROR(st->BootServices->AllocatePages(AllocateAddress, EfiLoaderData, pages, &segment))) {
+            log_error(L"Can't allocate kernel segment at 0x%lx!\n", phdr->p_paddr);
+            fatal();
+        }
+
+        CopyMem((void*)segment, image + phdr->p_offset, phdr->p_filesz);
+        SetMem((uint8_t*)segment + phdr->p_filesz, phdr->p_memsz - phdr->p_filesz, 0);
+        paging_add_segment(phdr->p_vaddr, phdr->p_paddr, phdr->p_memsz);
+    }
+
+    timing_end(stage);
+    return header->e_entry;
+}
+
+
+void boot(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE* st) {
+    Elf64_Addr entry;
+    UINTN stage;
+
+    // Prefer the kernel out of the boot pack.
+    UINTN image_size;
+    void* image = fpack_loaded() ? fpack_find(KERNEL_PATH, &image_size) : NULL;
+
+    if (image != NULL) {
+        entry = load_kernel_image(image, image_size, st);
+    } else {
+        EFI_STATUS s = EFI_UNSUPPORTED;
+
+#if KERNEL_LOAD_IN_MEMORY
+        // Whole image with one (possibly prefetched) read.
+        stage = timing_begin("boot.read_image");
+        s = fs_session_fetch(KERNEL_PATH, &image, &image_size);
+        timing_end(stage);
+
+        if (!EFI_ERROR(s)) {
+            entry = load_kernel_image(image, image_size, st);
+            st->BootServices->FreePages((EFI_PHYSICAL_ADDRESS)image, EFI_SIZE_TO_PAGES(image_size));
+        } else {
+            log_info(L"Falling back to streamed kernel load.\n");
+        }
+#endif
+
+        if (EFI_ERROR(s)) {
+            // Get the kernel file.
+            stage = timing_begin("boot.open_kernel");
+            EFI_FILE* kernel = load_file(KERNEL_PATH);
+            timing_end(stage);
+
+            entry = load_kernel_streamed(kernel, st);
+            fs_session_close_file(kernel);
+        }
+    }
+
+    // Done with the boot volume.
+    fs_session_close();
+
+#if KERNEL_PAGE_TABLES
+    // Build the kernel's page tables while we can still allocate.
+    stage = timing_begin("page_tables");
+    if (EFI_ERROR(paging_build())) {
+        // Only an identity-linked kernel can run on the firmware's tables.
+        if (paging_required()) {
+            log_error(L"Kernel is linked away from its load address but has no page tables!\n");
+            fatal();
+        }
+
+        log_info(L"Entering the kernel on the firmware page tables.\n");
+    }
+    timing_end(stage);
+#endif
+
     // Reset Console-Out (i.e clearing buffer).
     st->ConOut->Reset(st->ConOut, 1);
-    void(*kernel_entry)(struct FacelessServices*) = ((__attribute__((sysv_abi))void(*)(struct FacelessServices*))header.e_entry);
+    void(*kernel_entry)(struct FacelessServices*) = ((__attribute__((sysv_abi))void(*)(struct FacelessServices*))entry);
 
-    // Exit boot-services.
-    st->BootServices->ExitBootServices(image_handle, mmap_key);
+    // Take the final memory map and exit boot-services.
+    stage = timing_begin("exit_boot_services");
+    if (EFI_ERROR(memmap_exit_boot_services(image_handle))) {
+        fatal();
+    }
+    timing_end(stage);
+
+    // Switch to the kernel's page tables.
+    paging_activate();
 
     // Call kernel.
+    fs.timing.tsc_handoff = rdtsc();
     kernel_entry(&fs);
 }
 
@@ -446,22 +672,88 @@ void boot(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE* st) {
 
 // Entry point.
 EFI_STATUS efi_main(EFI_HANDLE imageHandle, EFI_SYSTEM_TABLE* sysTable) {
+    uint64_t tsc_entry = rdtsc();
     InitializeLib(imageHandle, sysTable);
+    log_init();
+
+    // Calibrate the TSC and start the boot timing table.
+    timing_init(tsc_entry);
+    UINTN stage;
+
+    // Open the boot volume once for every file we load.
+    stage = timing_begin("fs_session_open");
+    if (EFI_ERROR(fs_session_open(imageHandle, sysTable))) {
+        fatal();
+    }
+    timing_end(stage);
+
+    // Start reading everything we need, the device works while we greet.
+    stage = timing_begin("prefetch");
+    prefetch_assets();
+    timing_end(stage);
 
     // Greet the user, always be nice! :)
+    stage = timing_begin("greet");
     greet();
+    timing_end(stage);
 
     // Setup services..
+    stage = timing_begin("setup_services");
     setup_services(sysTable);
+    timing_end(stage);
+
+    // Record what the firmware enumerated on PCI.
+    stage = timing_begin("pci_inventory");
+    pci_inventory();
+    timing_end(stage);
+
+    // Find the other processors for CPU-bound work.
+    stage = timing_begin("mp_init");
+    mp_init();
+    timing_end(stage);
+
+    // Snapshot CPUID and the processor topology for the kernel.
+    stage = timing_begin("cpu_info");
+    cpu_info_snapshot();
+    timing_end(stage);
+
+    // Pull in the boot pack if there is one.
+    stage = timing_begin("fpack_open");
+    if (EFI_ERROR(fpack_open(FPACK_PATH))) {
+        log_info(L"No usable boot pack, loading loose files.\n");
+    }
+    timing_end(stage);
+
+    // Checksum and unpack its entries on every processor.
+    stage = timing_begin("fpack_prepare");
+    fpack_prepare(stage);
+    timing_end(stage);
 
     // Load a runtime font.
-    load_font(imageHandle, sysTable);
+    stage = timing_begin("load_font");
+    load_font(sysTable);
+    timing_end(stage);
 
     // Set GOP.
-    init_gop(sysTable);
+    stage = timing_begin("init_gop");
+    init_gop();
+    timing_end(stage);
+
+#if FRAMEBUF_TEXT_BENCH
+    stage = timing_begin("text_bench");
+    text_bench();
+    timing_end(stage);
+#endif
 
     // Load all BMPs.
-    load_all_bmps(imageHandle, sysTable);
+    stage = timing_begin("load_all_bmps");
+    load_all_bmps();
+    timing_end(stage);
+
+    // Convert them for blitting.
+    stage = timing_begin("bmp_convert");
+    surface_convert_all(stage);
+    timing_end(stage);
 
     // Finally, boot.
     boot(imageHandle, sysTable);
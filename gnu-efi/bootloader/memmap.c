@@ -0,0 +1,375 @@
+/*
+ *  MIT License
+ *
+ *  Copyright (c) 2022 FacelessSociety, Ian Marco Moffett
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+
+#include <efi.h>
+#include <efilib.h>
+#include <common/services.h>
+#include <common/memmap.h>
+#include <common/log.h>
+
+// Extra descriptors to leave room for, the map grows as we allocate.
+#define MEMMAP_SLACK 16
+
+extern struct FacelessServices fs;
+
+static EFI_MEMORY_DESCRIPTOR* raw_map = NULL;
+static UINTN raw_capacity = 0;
+static UINTN region_capacity = 0;
+
+static EFI_STATUS reserve_frame_bitmap(void);
+
+
+/*
+ *  Allocates room for the final raw and normalized maps, so
+ *  nothing has to be allocated once the map key matters.
+ *
+ */
+
+EFI_STATUS memmap_reserve(void) {
+    UINTN map_size = 0, map_key, descriptor_size;
+    UINT32 descriptor_version;
+    struct BootMemRegion* regions;
+
+    EFI_STATUS s = BS->GetMemoryMap(&map_size, NULL, &map_key, &descriptor_size, &descriptor_version);
+
+    if (s != EFI_BUFFER_TOO_SMALL) {
+        log_error(L"GetMemoryMap() failed to report its size (%r).\n", s);
+        return EFI_ERROR(s) ? s : EFI_DEVICE_ERROR;
+    }
+
+    // Both pools below may add descriptors of their own.
+    UINTN count = map_size / descriptor_size + MEMMAP_SLACK;
+
+    s = BS->AllocatePool(EfiLoaderData, count * descriptor_size, (void**)&raw_map);
+
+    if (EFI_ERROR(s)) {
+        return s;
+    }
+
+    s = BS->AllocatePool(EfiLoaderData, count * sizeof(struct BootMemRegion), (void**)&regions);
+
+    if (EFI_ERROR(s)) {
+        BS->FreePool(raw_map);
+        raw_map = NULL;
+        return s;
+    }
+
+    raw_capacity = count * descriptor_size;
+    region_capacity = count;
+    fs.memmap.regions = regions;
+    fs.memmap.nregions = 0;
+
+#if FRAME_BITMAP
+    return reserve_frame_bitmap();
+#else
+    return EFI_SUCCESS;
+#endif
+}
+
+
+// Types whose frames the kernel may end up owning.
+static BOOLEAN is_ram(uint32_t type) {
+    switch (type) {
+        case EfiLoaderCode:
+        case EfiLoaderData:
+        case EfiBootServicesCode:
+        case EfiBootServicesData:
+        case EfiConventionalMemory:
+            return TRUE;
+        default:
+            return FALSE;
+    }
+}
+
+
+// Sizes the frame bitmap off a first pass over the map and allocates it.
+static EFI_STATUS reserve_frame_bitmap(void) {
+    UINTN key;
+    uint64_t top = 0;
+    EFI_PHYSICAL_ADDRESS addr;
+    EFI_STATUS s = memmap_finalize(&key);
+
+    if (EFI_ERROR(s)) {
+        return s;
+    }
+
+    for (UINTN i = 0; i < fs.memmap.nregions; ++i) {
+        struct BootMemRegion* region = &fs.memmap.regions[i];
+
+        if (is_ram(region->type)) {
+            top = region->base + region->npages * EFI_PAGE_SIZE;
+        }
+    }
+
+    uint64_t nframes = top / EFI_PAGE_SIZE;
+    UINTN bytes = ((nframes + 63) / 64) * sizeof(uint64_t);
+
+    // The bitmap's own pages are loader data, so they end up used.
+    s = BS->AllocatePages(AllocateAnyPages, EfiLoaderData, EFI_SIZE_TO_PAGES(bytes), &addr);
+
+    if (EFI_ERROR(s)) {
+        log_error(L"Failed to allocate a %d byte frame bitmap.\n", bytes);
+        return s;
+    }
+
+    fs.frames.bits = (uint64_t*)addr;
+    fs.frames.nframes = nframes;
+    return EFI_SUCCESS;
+}
+
+
+// Marks frames [first, last) free.
+static void clear_frames(uint64_t* bits, uint64_t first, uint64_t last) {
+    for (; first < last && (first & 63); ++first) {
+        bits[first / 64] &= ~(1ULL << (first & 63));
+    }
+
+    uint64_t words = (last - first) / 64;
+
+    if (first < last && words > 0) {
+        SetMem(&bits[first / 64], words * sizeof(uint64_t), 0);
+        first += words * 64;
+    }
+
+    for (; first < last; ++first) {
+        bits[first / 64] &= ~(1ULL << (first & 63));
+    }
+}
+
+
+/*
+ *  Rebuilds the frame bitmap from the normalized map. Only
+ *  conventional memory is free, so loader, kernel, boot services
+ *  and framebuffer frames all start out used. Frame 0 is never
+ *  handed out.
+ *
+ */
+
+static void fill_frame_bitmap(void) {
+    struct BootFrameBitmap* frames = &fs.frames;
+
+    SetMem(frames->bits, ((frames->nframes + 63) / 64) * sizeof(uint64_t), 0xFF);
+    frames->free_frames = 0;
+    frames->first_free = frames->nframes;
+
+    for (UINTN i = 0; i < fs.memmap.nregions; ++i) {
+        struct BootMemRegion* region = &fs.memmap.regions[i];
+
+        if (region->type != EfiConventionalMemory) {
+            continue;
+        }
+
+        uint64_t first = region->base / EFI_PAGE_SIZE;
+        uint64_t last = first + region->npages;
+
+        first = first ? first : 1;
+        last = last < frames->nframes ? last : frames->nframes;
+
+        if (first >= last) {
+            continue;
+        }
+
+        clear_frames(frames->bits, first, last);
+        frames->free_frames += last - first;
+
+        // Regions are sorted, the first free one has the lowest frame.
+        if (frames->first_free == frames->nframes) {
+            frames->first_free = first;
+        }
+    }
+}
+
+
+// Sorts regions by base, the firmware map is mostly sorted already.
+static void sort_regions(struct BootMemRegion* regions, UINTN n) {
+    for (UINTN i = 1; i < n; ++i) {
+        struct BootMemRegion tmp = regions[i];
+        UINTN j = i;
+
+        while (j > 0 && regions[j - 1].base > tmp.base) {
+            regions[j] = regions[j - 1];
+            --j;
+        }
+
+        regions[j] = tmp;
+    }
+}
+
+
+/*
+ *  Fetches the final memory map and turns it into the sorted,
+ *  coalesced region array handed to the kernel.
+ *
+ *  @key: Set to the map key for ExitBootServices().
+ *
+ *  Calls no boot service other than GetMemoryMap(), so the key
+ *  stays valid.
+ *
+ */
+
+EFI_STATUS memmap_finalize(UINTN* key) {
+    UINTN map_size = raw_capacity, descriptor_size;
+    UINT32 descriptor_version;
+
+    if (raw_map == NULL) {
+        return EFI_NOT_READY;
+    }
+
+    EFI_STATUS s = BS->GetMemoryMap(&map_size, raw_map, key, &descriptor_size, &descriptor_version);
+
+    if (EFI_ERROR(s)) {
+        return s;
+    }
+
+    struct BootMemRegion* regions = fs.memmap.regions;
+    UINTN n = 0;
+
+    for (UINTN off = 0; off + descriptor_size <= map_size && n < region_capacity; off += descriptor_size) {
+        EFI_MEMORY_DESCRIPTOR* desc = (EFI_MEMORY_DESCRIPTOR*)((uint8_t*)raw_map + off);
+
+        if (desc->NumberOfPages == 0) {
+            continue;
+        }
+
+        regions[n].base = desc->PhysicalStart;
+        regions[n].npages = desc->NumberOfPages;
+        regions[n].attr = desc->Attribute;
+        regions[n].type = desc->Type;
+        regions[n].reserved = 0;
+        ++n;
+    }
+
+    sort_regions(regions, n);
+
+    // Coalesce touching regions of the same kind and total them up.
+    struct BootMemoryMap* map = &fs.memmap;
+    UINTN out = 0;
+
+    map->usable_bytes = 0;
+    map->reclaimable_bytes = 0;
+    map->largest_free_base = 0;
+    map->largest_free_pages = 0;
+
+    for (UINTN i = 0; i < n; ++i) {
+        struct BootMemRegion* last = out ? &regions[out - 1] : NULL;
+
+        if (last != NULL && last->type == regions[i].type && last->attr == regions[i].attr &&
+                last->base + last->npages * EFI_PAGE_SIZE == regions[i].base) {
+            last->npages += regions[i].npages;
+        } else {
+            regions[out++] = regions[i];
+        }
+    }
+
+    for (UINTN i = 0; i < out; ++i) {
+        uint64_t bytes = regions[i].npages * EFI_PAGE_SIZE;
+
+        switch (regions[i].type) {
+            case EfiConventionalMemory:
+                map->usable_bytes += bytes;
+
+                if (regions[i].npages > map->largest_free_pages) {
+                    map->largest_free_base = regions[i].base;
+                    map->largest_free_pages = regions[i].npages;
+                }
+                break;
+            case EfiBootServicesCode:
+            case EfiBootServicesData:
+                map->reclaimable_bytes += bytes;
+                break;
+            default:
+                break;
+        }
+    }
+
+    map->nregions = out;
+    map->highest_addr = out ? regions[out - 1].base + regions[out - 1].npages * EFI_PAGE_SIZE : 0;
+
+    if (fs.frames.bits != NULL) {
+        fill_frame_bitmap();
+    }
+
+    // The raw map stays available for anything that wants descriptors.
+    fs.mmap.mMap = raw_map;
+    fs.mmap.mSize = map_size;
+    fs.mmap.mDescriptorSize = descriptor_size;
+    return EFI_SUCCESS;
+}
+
+
+/*
+ *  Takes the final memory map and leaves boot services.
+ *
+ *  @image: Loader image handle.
+ *
+ *  The map is taken twice: once to log it while logging may
+ *  still allocate, and once more right before the exit. If the
+ *  key goes stale anyway it's refetched and retried.
+ *
+ */
+
+EFI_STATUS memmap_exit_boot_services(EFI_HANDLE image) {
+    UINTN key;
+    EFI_STATUS s = memmap_reserve();
+
+    if (!EFI_ERROR(s)) {
+        s = memmap_finalize(&key);
+    }
+
+    if (EFI_ERROR(s)) {
+        log_error(L"FATAL: Failed to get the memory map (%r)!\n", s);
+        return s;
+    }
+
+    log_debug(L"Memory map: %d regions, %d MiB usable, %d MiB reclaimable, largest free run %d MiB at 0x%lx.\n",
+            fs.memmap.nregions,
+            fs.memmap.usable_bytes >> 20,
+            fs.memmap.reclaimable_bytes >> 20,
+            (fs.memmap.largest_free_pages * EFI_PAGE_SIZE) >> 20,
+            fs.memmap.largest_free_base);
+
+    if (fs.frames.bits != NULL) {
+        log_debug(L"Frame bitmap: %d frames, %d free, first free frame %d.\n",
+                fs.frames.nframes,
+                fs.frames.free_frames,
+                fs.frames.first_free);
+    }
+
+    for (UINTN attempt = 0; attempt < 2; ++attempt) {
+        s = memmap_finalize(&key);
+
+        if (EFI_ERROR(s)) {
+            return s;
+        }
+
+        s = BS->ExitBootServices(image, key);
+
+        if (s != EFI_INVALID_PARAMETER) {
+            break;
+        }
+    }
+
+    return s;
+}
@@ -0,0 +1,148 @@
+/*
+ *  MIT License
+ *
+ *  Copyright (c) 2022 FacelessSociety, Ian Marco Moffett
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+
+#include <efi.h>
+#include <efilib.h>
+#include <efimp.h>
+#include <config.h>
+#include <common/mp.h>
+#include <common/log.h>
+#include <common/timing.h>
+
+static EFI_MP_SERVICES_PROTOCOL* mp = NULL;
+static UINTN enabled_cpus = 1;
+
+
+// Job queue shared by the BSP and the APs.
+struct MpQueue {
+    struct MpJob* jobs;
+    UINTN njobs;
+    volatile UINTN next;                // Next job to hand out.
+    volatile uint64_t work;
+    volatile UINTN ncpus;
+};
+
+
+// Pulls jobs off the queue until it's empty.
+static VOID EFIAPI mp_worker(VOID* arg) {
+    struct MpQueue* queue = arg;
+    BOOLEAN counted = FALSE;
+
+    for (;;) {
+        UINTN i = __atomic_fetch_add(&queue->next, 1, __ATOMIC_ACQ_REL);
+
+        if (i >= queue->njobs) {
+            break;
+        }
+
+        if (!counted) {
+            __atomic_fetch_add(&queue->ncpus, 1, __ATOMIC_RELAXED);
+            counted = TRUE;
+        }
+
+        uint64_t start = rdtsc();
+        queue->jobs[i].fn(queue->jobs[i].arg);
+        __atomic_fetch_add(&queue->work, rdtsc() - start, __ATOMIC_RELAXED);
+    }
+}
+
+
+// Finds the MP Services protocol, without it everything runs on the BSP.
+void mp_init(void) {
+#if MP_BOOT_WORK
+    EFI_GUID mp_guid = EFI_MP_SERVICES_PROTOCOL_GUID;
+    UINTN ncpus;
+
+    if (EFI_ERROR(BS->LocateProtocol(&mp_guid, NULL, (void**)&mp))) {
+        log_info(L"No MP Services protocol, boot work stays on the BSP.\n");
+        mp = NULL;
+        return;
+    }
+
+    if (EFI_ERROR(mp->GetNumberOfProcessors(mp, &ncpus, &enabled_cpus)) || enabled_cpus < 2) {
+        mp = NULL;
+        enabled_cpus = 1;
+        return;
+    }
+
+    log_info(L"%d/%d processors enabled for boot work.\n", enabled_cpus, ncpus);
+#endif
+}
+
+
+UINTN mp_cpu_count(void) {
+    return enabled_cpus;
+}
+
+
+/*
+ *  Runs jobs on every enabled processor and returns once all
+ *  of them are done. The BSP works the queue too, and does it
+ *  alone if the APs can't be started.
+ *
+ *  @jobs: Jobs to run.
+ *  @njobs: Number of jobs.
+ *
+ */
+
+struct MpRun mp_run(struct MpJob* jobs, UINTN njobs) {
+    struct MpQueue queue = {
+        .jobs = jobs,
+        .njobs = njobs,
+        .next = 0,
+        .work = 0,
+        .ncpus = 0
+    };
+
+    EFI_EVENT done = NULL;
+    BOOLEAN aps_started = FALSE;
+
+    if (mp != NULL && njobs > 1 && !EFI_ERROR(BS->CreateEvent(0, 0, NULL, NULL, &done))) {
+        // Non-blocking, so the BSP can take jobs as well.
+        EFI_STATUS s = mp->StartupAllAPs(mp, mp_worker, FALSE, done, 0, &queue, NULL);
+
+        if (EFI_ERROR(s)) {
+            log_debug(L"StartupAllAPs() failed (%r), running jobs on the BSP.\n", s);
+            BS->CloseEvent(done);
+        } else {
+            aps_started = TRUE;
+        }
+    }
+
+    mp_worker(&queue);
+
+    if (aps_started) {
+        UINTN index;
+        BS->WaitForEvent(1, &done, &index);
+        BS->CloseEvent(done);
+    }
+
+    struct MpRun run = {
+        .work = queue.work,
+        .ncpus = queue.ncpus
+    };
+
+    return run;
+}
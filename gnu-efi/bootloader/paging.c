@@ -0,0 +1,405 @@
+/*
+ *  MIT License
+ *
+ *  Copyright (c) 2022 FacelessSociety, Ian Marco Moffett
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+
+#include <efi.h>
+#include <efilib.h>
+#include <common/services.h>
+#include <common/paging.h>
+#include <common/log.h>
+#include <common/timing.h>
+
+#define PTE_PRESENT (1ULL << 0)
+#define PTE_WRITE (1ULL << 1)
+#define PTE_PWT (1ULL << 3)
+#define PTE_PCD (1ULL << 4)
+#define PTE_LARGE (1ULL << 7)
+#define PTE_PAT (1ULL << 7)
+#define PTE_PAT_LARGE (1ULL << 12)
+#define PTE_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+// PAT entry 7 (PAT|PCD|PWT), reprogrammed to write-combining.
+#define PTE_WC (PTE_PAT | PTE_PCD | PTE_PWT)
+#define PTE_WC_LARGE (PTE_PAT_LARGE | PTE_PCD | PTE_PWT)
+#define MSR_PAT 0x277
+#define PAT_WC 0x01
+
+#define GIB (1ULL << 30)
+#define MIB2 (1ULL << 21)
+
+// PML4 slots below DIRECT_MAP_BASE, the identity map can't grow past them.
+#define MAX_MAPPED_MEMORY (256ULL * 512 * GIB)
+
+// Kernel segments tracked for mapping, and spare tables for them.
+#define PAGING_MAX_SEGMENTS 16
+#define PAGING_SPARE_TABLES 32
+
+extern struct FacelessServices fs;
+
+struct Segment {
+    uint64_t vaddr;
+    uint64_t paddr;
+    uint64_t size;
+};
+
+static struct Segment segments[PAGING_MAX_SEGMENTS];
+static UINTN nsegments = 0;
+
+// Set once a segment is linked away from its load address.
+static BOOLEAN relocated = FALSE;
+static BOOLEAN dropped = FALSE;
+
+// Table pool, one allocation so the memory map barely changes.
+static uint64_t* pool = NULL;
+static UINTN pool_used = 0;
+static UINTN pool_pages = 0;
+
+
+// Records a PT_LOAD segment to be mapped at its link address.
+void paging_add_segment(uint64_t vaddr, uint64_t paddr, uint64_t size) {
+    if (vaddr == paddr) {
+        return;
+    }
+
+    relocated = TRUE;
+
+    if (nsegments == PAGING_MAX_SEGMENTS) {
+        dropped = TRUE;
+        return;
+    }
+
+    segments[nsegments].vaddr = vaddr;
+    segments[nsegments].paddr = paddr;
+    segments[nsegments].size = size;
+    ++nsegments;
+}
+
+
+// TRUE if some segment only runs on the loader-built tables.
+BOOLEAN paging_required(void) {
+    return relocated;
+}
+
+
+static uint64_t* alloc_table(void) {
+    if (pool_used == pool_pages) {
+        return NULL;
+    }
+
+    return pool + 512 * pool_used++;
+}
+
+
+// Returns the end of the highest physical range the kernel may touch.
+static uint64_t physical_top(void) {
+    UINTN map_size = 0, map_key, descriptor_size;
+    UINT32 descriptor_version;
+    EFI_MEMORY_DESCRIPTOR* map = NULL;
+    uint64_t top = 4 * GIB;
+
+    if (BS->GetMemoryMap(&map_size, NULL, &map_key, &descriptor_size, &descriptor_version) == EFI_BUFFER_TOO_SMALL) {
+        map_size += 2 * descriptor_size;
+
+        if (!EFI_ERROR(BS->AllocatePool(EfiLoaderData, map_size, (void**)&map))) {
+            if (!EFI_ERROR(BS->GetMemoryMap(&map_size, map, &map_key, &descriptor_size, &descriptor_version))) {
+                for (UINTN off = 0; off + descriptor_size <= map_size; off += descriptor_size) {
+                    EFI_MEMORY_DESCRIPTOR* desc = (EFI_MEMORY_DESCRIPTOR*)((uint8_t*)map + off);
+                    uint64_t end = desc->PhysicalStart + desc->NumberOfPages * EFI_PAGE_SIZE;
+                    top = end > top ? end : top;
+                }
+            }
+
+            BS->FreePool(map);
+        }
+    }
+
+    uint64_t fb_end = (uint64_t)fs.framebuffer.base_addr + fs.framebuffer.buffer_size;
+    top = fb_end > top ? fb_end : top;
+    top = (top + GIB - 1) & ~(GIB - 1);
+    return top < MAX_MAPPED_MEMORY ? top : MAX_MAPPED_MEMORY;
+}
+
+
+static BOOLEAN has_gib_pages(void) {
+    uint32_t a, b, c, d;
+    cpuid(0x80000000, 0, &a, &b, &c, &d);
+
+    if (a < 0x80000001) {
+        return FALSE;
+    }
+
+    cpuid(0x80000001, 0, &a, &b, &c, &d);
+    return (d & (1 << 26)) != 0;
+}
+
+
+// Maps one 4 KiB page, failing on clashes with the large page maps.
+static EFI_STATUS map_page(uint64_t* pml4, uint64_t vaddr, uint64_t paddr) {
+    uint64_t* table = pml4;
+
+    for (int shift = 39; shift > 12; shift -= 9) {
+        uint64_t* entry = &table[(vaddr >> shift) & 0x1FF];
+
+        if (*entry & PTE_LARGE) {
+            return EFI_INVALID_PARAMETER;
+        }
+
+        if (!(*entry & PTE_PRESENT)) {
+            uint64_t* next = alloc_table();
+
+            if (next == NULL) {
+                return EFI_OUT_OF_RESOURCES;
+            }
+
+            *entry = (uint64_t)next | PTE_PRESENT | PTE_WRITE;
+        }
+
+        table = (uint64_t*)(*entry & PTE_ADDR_MASK);
+    }
+
+    table[(vaddr >> 12) & 0x1FF] = paddr | PTE_PRESENT | PTE_WRITE;
+    return EFI_SUCCESS;
+}
+
+
+static BOOLEAN has_pat(void) {
+    uint32_t a, b, c, d;
+    cpuid(1, 0, &a, &b, &c, &d);
+    return (d & (1 << 16)) != 0;
+}
+
+
+/*
+ *  Replaces the large page at @entry with a table of 512
+ *  pages of @child_size covering the same range, WB as before.
+ *  Returns the table, or the existing one if already split.
+ *
+ */
+
+static uint64_t* split_large(uint64_t* entry, uint64_t child_size) {
+    if (!(*entry & PTE_LARGE)) {
+        return (uint64_t*)(*entry & PTE_ADDR_MASK);
+    }
+
+    uint64_t* table = alloc_table();
+
+    if (table == NULL) {
+        return NULL;
+    }
+
+    uint64_t base = *entry & PTE_ADDR_MASK;
+    uint64_t flags = PTE_PRESENT | PTE_WRITE | (child_size > EFI_PAGE_SIZE ? PTE_LARGE : 0);
+
+    for (UINTN i = 0; i < 512; ++i) {
+        table[i] = (base + i * child_size) | flags;
+    }
+
+    *entry = (uint64_t)table | PTE_PRESENT | PTE_WRITE;
+    return table;
+}
+
+
+/*
+ *  Marks the framebuffer write-combining in the identity map,
+ *  and with it in the direct map as both share their PDPTs.
+ *  Whole 2 MiB pages are used where the range covers them,
+ *  4 KiB pages at the unaligned ends.
+ *
+ */
+
+static EFI_STATUS map_framebuffer(uint64_t* pml4, uint64_t base, uint64_t end) {
+    uint64_t addr = base & ~0xFFFULL;
+
+    while (addr < end) {
+        uint64_t* pdpt = (uint64_t*)(pml4[(addr >> 39) & 0x1FF] & PTE_ADDR_MASK);
+        uint64_t* pd = split_large(&pdpt[(addr >> 30) & 0x1FF], MIB2);
+
+        if (pd == NULL) {
+            return EFI_OUT_OF_RESOURCES;
+        }
+
+        uint64_t* pde = &pd[(addr >> 21) & 0x1FF];
+
+        if ((addr & (MIB2 - 1)) == 0 && addr + MIB2 <= end) {
+            *pde = addr | PTE_PRESENT | PTE_WRITE | PTE_LARGE | PTE_WC_LARGE;
+            addr += MIB2;
+            continue;
+        }
+
+        uint64_t* pt = split_large(pde, EFI_PAGE_SIZE);
+
+        if (pt == NULL) {
+            return EFI_OUT_OF_RESOURCES;
+        }
+
+        pt[(addr >> 12) & 0x1FF] = addr | PTE_PRESENT | PTE_WRITE | PTE_WC;
+        addr += EFI_PAGE_SIZE;
+    }
+
+    return EFI_SUCCESS;
+}
+
+
+/*
+ *  Builds the page tables the kernel is entered on:
+ *
+ *  - Physical memory and the framebuffer identity mapped, the
+ *    kernel is linked at its load address and every pointer in
+ *    FacelessServices is physical.
+ *  - The same range again at DIRECT_MAP_BASE. Both maps share
+ *    their PDPTs and use 1 GiB pages where CPUID allows, 2 MiB
+ *    pages otherwise.
+ *  - The framebuffer write-combining (PAT entry 7) in both maps,
+ *    the rest write-back.
+ *  - Kernel segments at their link address when it differs from
+ *    the load address, with 4 KiB pages.
+ *
+ *  Must run before the final memory map is taken.
+ *
+ */
+
+EFI_STATUS paging_build(void) {
+    uint64_t cr4;
+    __asm__ __volatile__("mov %%cr4, %0" : "=r"(cr4));
+
+    // 5-level paging is on, our 4-level tables won't do.
+    if (cr4 & (1 << 12)) {
+        return EFI_UNSUPPORTED;
+    }
+
+    if (dropped) {
+        log_error(L"More than %d relocated kernel segments.\n", PAGING_MAX_SEGMENTS);
+        return EFI_UNSUPPORTED;
+    }
+
+    uint64_t top = physical_top();
+    BOOLEAN gib_pages = has_gib_pages();
+    UINTN ngib = top / GIB;
+    UINTN npdpt = (ngib + 511) / 512;
+    UINTN npd = gib_pages ? 0 : ngib;
+
+    // A PD per GiB the framebuffer touches, a PT for either ragged end.
+    uint64_t fb_base = (uint64_t)fs.framebuffer.base_addr;
+    uint64_t fb_end = fb_base + fs.framebuffer.buffer_size;
+    BOOLEAN fb_wc = fs.framebuffer.buffer_size != 0 && fb_end <= top && has_pat();
+    UINTN nfb = fb_wc ? 2 + (gib_pages ? (fb_end - 1) / GIB - fb_base / GIB + 1 : 0) : 0;
+
+    pool_pages = 1 + npdpt + npd + nfb + PAGING_SPARE_TABLES;
+    EFI_PHYSICAL_ADDRESS addr;
+
+    if (EFI_ERROR(BS->AllocatePages(AllocateAnyPages, EfiLoaderData, pool_pages, &addr))) {
+        log_error(L"Failed to allocate %d pages for page tables.\n", pool_pages);
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    pool = (uint64_t*)addr;
+    pool_used = 0;
+    ZeroMem(pool, pool_pages * EFI_PAGE_SIZE);
+
+    uint64_t* pml4 = alloc_table();
+
+    for (UINTN i = 0; i < npdpt; ++i) {
+        uint64_t* pdpt = alloc_table();
+        pml4[i] = (uint64_t)pdpt | PTE_PRESENT | PTE_WRITE;
+        pml4[((DIRECT_MAP_BASE >> 39) & 0x1FF) + i] = pml4[i];
+    }
+
+    for (UINTN g = 0; g < ngib; ++g) {
+        uint64_t* pdpt = (uint64_t*)(pml4[g / 512] & PTE_ADDR_MASK);
+
+        if (gib_pages) {
+            pdpt[g % 512] = (g * GIB) | PTE_PRESENT | PTE_WRITE | PTE_LARGE;
+            continue;
+        }
+
+        uint64_t* pd = alloc_table();
+
+        for (UINTN i = 0; i < 512; ++i) {
+            pd[i] = (g * GIB + i * MIB2) | PTE_PRESENT | PTE_WRITE | PTE_LARGE;
+        }
+
+        pdpt[g % 512] = (uint64_t)pd | PTE_PRESENT | PTE_WRITE;
+    }
+
+    if (fb_wc && EFI_ERROR(map_framebuffer(pml4, fb_base, fb_end))) {
+        log_error(L"Can't map the framebuffer write-combining.\n");
+        BS->FreePages(addr, pool_pages);
+        pool = NULL;
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    for (UINTN i = 0; i < nsegments; ++i) {
+        uint64_t vaddr = segments[i].vaddr & ~0xFFFULL;
+        uint64_t paddr = segments[i].paddr & ~0xFFFULL;
+        uint64_t end = segments[i].vaddr + segments[i].size;
+
+        for (uint64_t off = 0; vaddr + off < end; off += EFI_PAGE_SIZE) {
+            EFI_STATUS s = map_page(pml4, vaddr + off, paddr + off);
+
+            if (EFI_ERROR(s)) {
+                log_error(L"Can't map kernel segment at 0x%lx (%r).\n", segments[i].vaddr, s);
+                BS->FreePages(addr, pool_pages);
+                pool = NULL;
+                return s;
+            }
+        }
+    }
+
+    fs.paging.pml4 = (uint64_t)pml4;
+    fs.paging.direct_map_base = DIRECT_MAP_BASE;
+    fs.paging.direct_map_size = top;
+    fs.paging.large_page_size = gib_pages ? GIB : MIB2;
+    fs.paging.tables_base = addr;
+    fs.paging.tables_used = pool_used;
+
+    log_info(L"Page tables: %d GiB mapped with %a pages, %d tables.\n",
+            ngib,
+            gib_pages ? "1 GiB" : "2 MiB",
+            pool_used);
+
+    return EFI_SUCCESS;
+}
+
+
+/*
+ *  Switches to the loader-built tables, only after ExitBootServices().
+ *  PAT entry 7 becomes WC first; it defaults to UC, so without PAT
+ *  the framebuffer entries still map it uncached.
+ *
+ */
+
+void paging_activate(void) {
+    if (fs.paging.pml4 == 0) {
+        return;
+    }
+
+    if (has_pat()) {
+        uint32_t lo, hi;
+        __asm__ __volatile__("rdmsr" : "=a"(lo), "=d"(hi) : "c"(MSR_PAT));
+        hi = (hi & 0x00FFFFFF) | ((uint32_t)PAT_WC << 24);
+        __asm__ __volatile__("wbinvd; wrmsr" :: "a"(lo), "d"(hi), "c"(MSR_PAT) : "memory");
+    }
+
+    __asm__ __volatile__("mov %0, %%cr3" :: "r"(fs.paging.pml4) : "memory");
+}
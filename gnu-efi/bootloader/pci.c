@@ -0,0 +1,189 @@
+/*
+ *  MIT License
+ *
+ *  Copyright (c) 2022 FacelessSociety, Ian Marco Moffett
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+
+#include <efi.h>
+#include <efilib.h>
+#include <common/pci.h>
+#include <common/log.h>
+
+// Config space header, the part read for each function.
+#define PCI_CONFIG_DWORDS 16
+
+#define PCI_HEADER_TYPE_MASK 0x7F
+#define PCI_HEADER_DEVICE 0
+#define PCI_HEADER_BRIDGE 1
+
+#define ACPI_QWORD_ADDRESS_SPACE 0x8A
+#define ACPI_END_TAG 0x79
+#define ACPI_ADDRESS_SPACE_IO 1
+
+extern struct FacelessServices fs;
+
+
+// Resource descriptor GetBarAttributes() hands back, ACPI 6.5 section 6.4.3.5.1.
+struct __attribute__((packed)) QwordAddressSpace {
+    uint8_t tag;
+    uint16_t length;
+    uint8_t resource_type;
+    uint8_t general_flags;
+    uint8_t type_flags;
+    uint64_t granularity;
+    uint64_t min;
+    uint64_t max;
+    uint64_t translation;
+    uint64_t range_length;
+};
+
+
+static inline uint64_t device_key(struct BootPciDevice* d) {
+    return ((uint64_t)d->segment << 24) | ((uint64_t)d->bus << 16) | ((uint64_t)d->device << 8) | d->function;
+}
+
+
+// Fills in a BAR from the firmware's resource descriptor and the BAR register.
+static void read_bar(EFI_PCI_IO_PROTOCOL* pci_io, uint8_t index, const uint32_t* config, struct BootPciBar* bar) {
+    struct QwordAddressSpace* desc = NULL;
+
+    bar->base = bar->length = 0;
+    bar->flags = 0;
+
+    if (EFI_ERROR(pci_io->GetBarAttributes(pci_io, index, NULL, (void**)&desc)) || desc == NULL) {
+        return;
+    }
+
+    if (desc->tag == ACPI_QWORD_ADDRESS_SPACE && desc->range_length != 0) {
+        uint32_t reg = config[4 + index];
+
+        bar->base = desc->min;
+        bar->length = desc->range_length;
+
+        if (desc->resource_type == ACPI_ADDRESS_SPACE_IO) {
+            bar->flags = PCI_BAR_IO;
+        } else {
+            bar->flags |= reg & 0x08 ? PCI_BAR_PREFETCHABLE : 0;
+            bar->flags |= (reg & 0x06) == 0x04 ? PCI_BAR_64BIT : 0;
+        }
+    }
+
+    FreePool(desc);
+}
+
+
+/*
+ *  Records every PCI function the firmware has a PCI I/O protocol
+ *  for in fs.pci, so the kernel doesn't have to scan config space.
+ *
+ */
+
+void pci_inventory(void) {
+    EFI_GUID guid = EFI_PCI_IO_PROTOCOL_GUID;
+    EFI_HANDLE* handles;
+    UINTN nhandles;
+
+    fs.pci.devices = NULL;
+    fs.pci.ndevices = 0;
+
+    EFI_STATUS s = BS->LocateHandleBuffer(ByProtocol, &guid, NULL, &nhandles, &handles);
+
+    if (EFI_ERROR(s)) {
+        log_info(L"No PCI I/O protocol (%r), no PCI inventory.\n", s);
+        return;
+    }
+
+    struct BootPciDevice* devices;
+
+    if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, (nhandles ? nhandles : 1) * sizeof(struct BootPciDevice), (void**)&devices))) {
+        log_error(L"Failed to allocate the PCI inventory.\n");
+        FreePool(handles);
+        return;
+    }
+
+    uint32_t ndevices = 0;
+
+    for (UINTN i = 0; i < nhandles; ++i) {
+        EFI_PCI_IO_PROTOCOL* pci_io;
+        uint32_t config[PCI_CONFIG_DWORDS];
+        UINTN segment, bus, device, function;
+
+        if (EFI_ERROR(BS->HandleProtocol(handles[i], &guid, (void**)&pci_io)) ||
+                EFI_ERROR(pci_io->GetLocation(pci_io, &segment, &bus, &device, &function)) ||
+                EFI_ERROR(pci_io->Pci.Read(pci_io, EfiPciIoWidthUint32, 0, PCI_CONFIG_DWORDS, config))) {
+            continue;
+        }
+
+        struct BootPciDevice d;
+        uint8_t header_type = (config[3] >> 16) & PCI_HEADER_TYPE_MASK;
+
+        ZeroMem(&d, sizeof(d));
+        d.segment = segment;
+        d.bus = bus;
+        d.device = device;
+        d.function = function;
+        d.header_type = header_type;
+        d.vendor_id = config[0];
+        d.device_id = config[0] >> 16;
+        d.revision = config[2];
+        d.prog_if = config[2] >> 8;
+        d.subclass = config[2] >> 16;
+        d.class_code = config[2] >> 24;
+        d.interrupt_line = config[15];
+        d.interrupt_pin = config[15] >> 8;
+
+        if (header_type == PCI_HEADER_DEVICE) {
+            d.subsystem_vendor_id = config[11];
+            d.subsystem_id = config[11] >> 16;
+        }
+
+        uint8_t nbars = header_type == PCI_HEADER_DEVICE ? 6 : header_type == PCI_HEADER_BRIDGE ? 2 : 0;
+
+        for (uint8_t b = 0; b < nbars; ++b) {
+            struct BootPciBar bar;
+            read_bar(pci_io, b, config, &bar);
+            d.bars[b] = bar;
+        }
+
+        // Insertion sort by location, handle order is arbitrary.
+        uint32_t at = ndevices++;
+
+        for (; at > 0 && device_key(&devices[at - 1]) > device_key(&d); --at) {
+            devices[at] = devices[at - 1];
+        }
+
+        devices[at] = d;
+    }
+
+    FreePool(handles);
+    fs.pci.devices = devices;
+    fs.pci.ndevices = ndevices;
+
+    for (uint32_t i = 0; i < ndevices; ++i) {
+        struct BootPciDevice* d = &devices[i];
+
+        log_debug(L"PCI %04x:%02x:%02x.%x %04x:%04x class %02x%02x%02x\n", d->segment, d->bus, d->device, d->function,
+                d->vendor_id, d->device_id, d->class_code, d->subclass, d->prog_if);
+    }
+
+    log_info(L"Found %d PCI functions.\n", ndevices);
+}
@@ -0,0 +1,246 @@
+/*
+ *  MIT License
+ *
+ *  Copyright (c) 2022 FacelessSociety, Ian Marco Moffett
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+
+#include <efi.h>
+#include <efilib.h>
+#include <common/smbios_index.h>
+#include <common/log.h>
+
+#define SMBIOS_END_OF_TABLE 127
+#define SMBIOS_TYPE_PROCESSOR 4
+#define SMBIOS_TYPE_MEMORY_DEVICE 17
+#define SMBIOS_TYPE_MEMORY_ARRAY_MAPPED 19
+
+extern struct FacelessServices fs;
+
+
+static BOOLEAN checksum_ok(const void* data, UINTN length) {
+    const uint8_t* p = data;
+    uint8_t sum = 0;
+
+    for (UINTN i = 0; i < length; ++i) {
+        sum += p[i];
+    }
+
+    return sum == 0;
+}
+
+
+/*
+ *  Finds the end of a structure's string set.
+ *
+ *  @p: Structure.
+ *  @end: End of the table.
+ *  @nstrings: Set to the number of strings.
+ *
+ *  Returns the next structure, or NULL if the strings run off the
+ *  end of the table.
+ *
+ */
+
+static const uint8_t* skip_strings(const uint8_t* p, const uint8_t* end, uint16_t* nstrings) {
+    const uint8_t* s = p + p[1];
+    *nstrings = 0;
+
+    // No strings is a lone double NUL.
+    if (s + 1 < end && s[0] == 0 && s[1] == 0) {
+        return s + 2;
+    }
+
+    while (s < end) {
+        if (*s++ != 0) {
+            continue;
+        }
+
+        ++*nstrings;
+
+        if (s < end && *s == 0) {
+            return s + 1;
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ *  Walks the table, counting structures per type and strings
+ *  when @index is NULL, filling it in otherwise.
+ *
+ *  Returns how many structures it saw.
+ *
+ */
+
+static uint32_t walk(const uint8_t* table, const uint8_t* end, uint32_t max_structures,
+        uint32_t* per_type, uint32_t* nstrings, struct BootSmbiosIndex* index) {
+    const uint8_t* p = table;
+    uint32_t n = 0;
+    uint32_t string = 0;
+
+    while (n < max_structures && p + 4 <= end && p[1] >= 4 && p + p[1] <= end && p[0] != SMBIOS_END_OF_TABLE) {
+        uint16_t count;
+        const uint8_t* next = skip_strings(p, end, &count);
+
+        if (next == NULL) {
+            break;
+        }
+
+        if (index == NULL) {
+            ++per_type[p[0]];
+        } else {
+            struct BootSmbiosStructure* s = &index->structures[per_type[p[0]]++];
+            const uint8_t* str = p + p[1];
+
+            s->address = (uint64_t)p;
+            s->handle = p[2] | (p[3] << 8);
+            s->type = p[0];
+            s->length = p[1];
+            s->first_string = string;
+            s->nstrings = count;
+            s->reserved = 0;
+
+            for (uint16_t i = 0; i < count; ++i) {
+                index->string_offsets[string + i] = str - p;
+
+                while (*str++ != 0) {
+                }
+            }
+        }
+
+        string += count;
+        p = next;
+        ++n;
+    }
+
+    *nstrings = string;
+    return n;
+}
+
+
+/*
+ *  Builds fs.smbios from the SMBIOS3 entry point, or the 2.x one if
+ *  there is no 64-bit table. Needs firmware_index_tables() to have
+ *  run.
+ *
+ */
+
+void smbios_index_tables(void) {
+    struct BootSmbiosIndex* index = &fs.smbios;
+    SMBIOS3_STRUCTURE_TABLE* entry3 = fs.firmware.smbios3;
+    SMBIOS_STRUCTURE_TABLE* entry = fs.firmware.smbios;
+    const uint8_t* table;
+    UINTN length;
+    uint32_t max_structures = ~0U;
+
+    ZeroMem(index, sizeof(*index));
+
+    if (entry3 != NULL && entry3->EntryPointLength >= sizeof(*entry3) && checksum_ok(entry3, entry3->EntryPointLength)) {
+        table = (const uint8_t*)entry3->TableAddress;
+        length = entry3->TableMaximumSize;
+        index->major = entry3->MajorVersion;
+        index->minor = entry3->MinorVersion;
+    } else if (entry != NULL && entry->EntryPointLength >= 0x1F && checksum_ok(entry, entry->EntryPointLength)) {
+        table = (const uint8_t*)(UINTN)entry->TableAddress;
+        length = entry->TableLength;
+        max_structures = entry->NumberOfSmbiosStructures;
+        index->major = entry->MajorVersion;
+        index->minor = entry->MinorVersion;
+    } else {
+        log_error(L"No valid SMBIOS entry point, SMBIOS is not indexed.\n");
+        return;
+    }
+
+    const uint8_t* end = table + length;
+    uint32_t per_type[SMBIOS_TYPES] = { 0 };
+    uint32_t nstrings;
+    uint32_t nstructures = walk(table, end, max_structures, per_type, &nstrings, NULL);
+
+    // Where each type starts once structures are grouped by type.
+    uint32_t start = 0;
+
+    for (UINTN t = 0; t < SMBIOS_TYPES; ++t) {
+        index->type_start[t] = start;
+        start += per_type[t];
+        per_type[t] = index->type_start[t];
+    }
+
+    index->type_start[SMBIOS_TYPES] = start;
+
+    UINTN bytes = nstructures * sizeof(struct BootSmbiosStructure) + (nstrings ? nstrings : 1) * sizeof(uint16_t);
+    uint8_t* buf;
+
+    if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, bytes, (void**)&buf))) {
+        log_error(L"Failed to allocate the SMBIOS index.\n");
+        ZeroMem(index, sizeof(*index));
+        return;
+    }
+
+    index->structures = (struct BootSmbiosStructure*)buf;
+    index->string_offsets = (uint16_t*)(buf + nstructures * sizeof(struct BootSmbiosStructure));
+    walk(table, end, max_structures, per_type, &nstrings, index);
+
+    index->nstructures = nstructures;
+    index->nstrings = nstrings;
+    index->table_address = (uint64_t)table;
+    index->table_length = length;
+
+    log_debug(L"SMBIOS %d.%d: %d structures, %d processors, %d memory devices, %d mapped arrays.\n",
+            index->major, index->minor, nstructures,
+            index->type_start[SMBIOS_TYPE_PROCESSOR + 1] - index->type_start[SMBIOS_TYPE_PROCESSOR],
+            index->type_start[SMBIOS_TYPE_MEMORY_DEVICE + 1] - index->type_start[SMBIOS_TYPE_MEMORY_DEVICE],
+            index->type_start[SMBIOS_TYPE_MEMORY_ARRAY_MAPPED + 1] - index->type_start[SMBIOS_TYPE_MEMORY_ARRAY_MAPPED]);
+}
+
+
+/*
+ *  Returns the @instance'th structure of @type in table order, or
+ *  NULL if there are not that many.
+ *
+ */
+
+const struct BootSmbiosStructure* smbios_find(uint8_t type, uint32_t instance) {
+    struct BootSmbiosIndex* index = &fs.smbios;
+
+    if (index->structures == NULL || instance >= index->type_start[type + 1] - index->type_start[type]) {
+        return NULL;
+    }
+
+    return &index->structures[index->type_start[type] + instance];
+}
+
+
+/*
+ *  Returns string @n of a structure, numbered from 1 as in the
+ *  formatted area. NULL for 0 or out of range numbers.
+ *
+ */
+
+const char* smbios_string(const struct BootSmbiosStructure* structure, uint8_t n) {
+    if (structure == NULL || n == 0 || n > structure->nstrings) {
+        return NULL;
+    }
+
+    return (const char*)structure->address + fs.smbios.string_offsets[structure->first_string + n - 1];
+}
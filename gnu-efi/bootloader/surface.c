@@ -0,0 +1,329 @@
+/*
+ *  MIT License
+ *
+ *  Copyright (c) 2022 FacelessSociety, Ian Marco Moffett
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+
+#include <efi.h>
+#include <efilib.h>
+#include <stddef.h>
+#include <tmmintrin.h>
+#include <common/surface.h>
+#include <common/log.h>
+#include <common/mp.h>
+#include <common/timing.h>
+
+// Rows converted per job handed to mp_run().
+#define ROWS_PER_JOB 64
+#define MAX_JOBS 256
+
+// Biggest BMP dimension accepted.
+#define SURFACE_MAX_DIM 16384
+
+extern struct FacelessServices fs;
+
+
+// How a BGR pixel turns into a framebuffer pixel.
+struct PixelFormat {
+    EFI_GRAPHICS_PIXEL_FORMAT format;
+    uint8_t shift[3];                   // Blue, green, red, PixelBitMask only.
+    uint8_t bits[3];
+};
+
+static struct PixelFormat pixel_format = { .format = PixelBlueGreenRedReserved8BitPerColor };
+static BOOLEAN has_ssse3 = FALSE;
+
+// Summed over every surface_from_bmp(), for the timing stage.
+static struct MpRun convert_run;
+
+
+// One band of rows of one BMP.
+struct ConvertJob {
+    const uint8_t* src;                 // First BMP row of the band, in file order.
+    INTN src_pitch;                     // Bytes to the next row, negative for bottom-up files.
+    uint32_t* dst;
+    uint32_t dst_stride;
+    uint32_t width;
+    uint32_t rows;
+    uint32_t bpp;
+};
+
+
+static void mask_to_shift(uint32_t mask, uint8_t* shift, uint8_t* bits) {
+    *shift = mask ? __builtin_ctz(mask) : 0;
+    *bits = __builtin_popcount(mask);
+}
+
+
+/*
+ *  Takes the pixel layout from the GOP mode, surfaces are built
+ *  in it so they can be copied straight to the framebuffer.
+ *
+ *  @info: Current GOP mode.
+ *
+ */
+
+void surface_set_format(EFI_GRAPHICS_OUTPUT_MODE_INFORMATION* info) {
+    uint32_t a, b, c, d;
+
+    pixel_format.format = info->PixelFormat;
+
+    if (info->PixelFormat == PixelBitMask) {
+        mask_to_shift(info->PixelInformation.BlueMask, &pixel_format.shift[0], &pixel_format.bits[0]);
+        mask_to_shift(info->PixelInformation.GreenMask, &pixel_format.shift[1], &pixel_format.bits[1]);
+        mask_to_shift(info->PixelInformation.RedMask, &pixel_format.shift[2], &pixel_format.bits[2]);
+    } else if (info->PixelFormat != PixelRedGreenBlueReserved8BitPerColor) {
+        // BGR and Blt-only modes both take BMP byte order.
+        pixel_format.format = PixelBlueGreenRedReserved8BitPerColor;
+    }
+
+    cpuid(1, 0, &a, &b, &c, &d);
+    has_ssse3 = (c & (1 << 9)) != 0;
+}
+
+
+static inline uint32_t scale(uint32_t v, uint8_t shift, uint8_t bits) {
+    v = bits >= 8 ? v << (bits - 8) : v >> (8 - bits);
+    return v << shift;
+}
+
+
+// Any format, a pixel at a time.
+static void convert_row_generic(uint32_t* dst, const uint8_t* src, uint32_t width, uint32_t bytes_pp) {
+    struct PixelFormat* pf = &pixel_format;
+
+    for (uint32_t x = 0; x < width; ++x, src += bytes_pp) {
+        uint32_t blue = src[0], green = src[1], red = src[2];
+
+        switch (pf->format) {
+            case PixelRedGreenBlueReserved8BitPerColor:
+                dst[x] = red | (green << 8) | (blue << 16);
+                break;
+            case PixelBitMask:
+                dst[x] = scale(blue, pf->shift[0], pf->bits[0]) |
+                    scale(green, pf->shift[1], pf->bits[1]) |
+                    scale(red, pf->shift[2], pf->bits[2]);
+                break;
+            default:
+                dst[x] = blue | (green << 8) | (red << 16);
+                break;
+        }
+    }
+}
+
+
+/*
+ *  24 or 32 bit BGR to 32-bit BGRX/RGBX, four pixels per pshufb.
+ *  Returns how many pixels it did, the rest go through the
+ *  generic path.
+ *
+ */
+
+__attribute__((target("ssse3")))
+static uint32_t convert_row_ssse3(uint32_t* dst, const uint8_t* src, uint32_t width, uint32_t bytes_pp) {
+    BOOLEAN rgb = pixel_format.format == PixelRedGreenBlueReserved8BitPerColor;
+    __m128i shuffle;
+    uint32_t x = 0;
+
+    if (bytes_pp == 3) {
+        shuffle = rgb ? _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1)
+                      : _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+
+        // Each 16 byte load covers 4 pixels plus 4 bytes of the next ones.
+        for (; x + 6 <= width; x += 4, src += 12) {
+            __m128i in = _mm_loadu_si128((const __m128i*)src);
+            _mm_storeu_si128((__m128i*)(dst + x), _mm_shuffle_epi8(in, shuffle));
+        }
+    } else {
+        shuffle = rgb ? _mm_setr_epi8(2, 1, 0, -1, 6, 5, 4, -1, 10, 9, 8, -1, 14, 13, 12, -1)
+                      : _mm_setr_epi8(0, 1, 2, -1, 4, 5, 6, -1, 8, 9, 10, -1, 12, 13, 14, -1);
+
+        for (; x + 4 <= width; x += 4, src += 16) {
+            __m128i in = _mm_loadu_si128((const __m128i*)src);
+            _mm_storeu_si128((__m128i*)(dst + x), _mm_shuffle_epi8(in, shuffle));
+        }
+    }
+
+    return x;
+}
+
+
+// Converts a band of rows, run by mp_run() so no boot services.
+static void convert_band(void* arg) {
+    struct ConvertJob* job = arg;
+    uint32_t bytes_pp = job->bpp / 8;
+    const uint8_t* src = job->src;
+    uint32_t* dst = job->dst;
+
+    for (uint32_t y = 0; y < job->rows; ++y, src += job->src_pitch, dst += job->dst_stride) {
+        uint32_t done = 0;
+
+        if (has_ssse3 && pixel_format.format != PixelBitMask) {
+            done = convert_row_ssse3(dst, src, job->width, bytes_pp);
+        }
+
+        convert_row_generic(dst + done, src + done * bytes_pp, job->width - done, bytes_pp);
+    }
+}
+
+
+/*
+ *  Converts a BMP into a top-down surface in the framebuffer's
+ *  pixel format, using every processor.
+ *
+ *  @bmp: Whole BMP file, 24 or 32 bits per pixel, uncompressed
+ *        or 32-bit BGRX bitfields.
+ *  @size: Size of the file.
+ *  @surface: Filled in on success.
+ *
+ */
+
+EFI_STATUS surface_from_bmp(struct BMP* bmp, UINTN size, struct BootSurface* surface) {
+    static struct ConvertJob jobs[MAX_JOBS];
+    static struct MpJob mp_jobs[MAX_JOBS];
+
+    // Both headers must be there before anything is read from them.
+    if (size < offsetof(struct BMP, color_table) || bmp->info_header.info_hdr_sz < sizeof(struct InfoHeader)) {
+        log_error(L"BMP headers are truncated!\n");
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    uint32_t width = bmp->info_header.width;
+    int32_t raw_height = (int32_t)bmp->info_header.height;
+    uint32_t height = raw_height < 0 ? -raw_height : raw_height;
+    uint32_t bpp = bmp->info_header.bits_per_pixel;
+    uint32_t compression = bmp->info_header.compression;
+
+    // BI_RGB, or BI_BITFIELDS with the usual 32-bit BGRA layout.
+    if ((bpp != 24 && bpp != 32) || (compression != 0 && !(compression == 3 && bpp == 32)) ||
+            width == 0 || height == 0 || width > SURFACE_MAX_DIM || height > SURFACE_MAX_DIM) {
+        log_error(L"Unsupported BMP (%dx%d, %d bpp, compression %d).\n", width, height, bpp, compression);
+        return EFI_UNSUPPORTED;
+    }
+
+    // Red, green and blue masks follow the 40 byte header, also inside V4/V5 ones.
+    if (compression == 3) {
+        uint32_t masks[3];
+
+        if (size < offsetof(struct BMP, color_table) + sizeof(masks)) {
+            log_error(L"BMP headers are truncated!\n");
+            return EFI_VOLUME_CORRUPTED;
+        }
+
+        CopyMem(masks, (uint8_t*)bmp + offsetof(struct BMP, color_table), sizeof(masks));
+
+        if (masks[0] != 0x00FF0000 || masks[1] != 0x0000FF00 || masks[2] != 0x000000FF) {
+            log_error(L"Unsupported BMP channel masks.\n");
+            return EFI_UNSUPPORTED;
+        }
+    }
+
+    UINTN pitch = ((width * bpp + 31) / 32) * 4;
+    UINTN offset = bmp->header.data_offset;
+
+    if (offset > size || pitch * height > size - offset) {
+        log_error(L"BMP pixel data is truncated!\n");
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    // Rows line up with the framebuffer when the image fits.
+    uint32_t stride = width <= fs.framebuffer.ppsl ? fs.framebuffer.ppsl : width;
+    EFI_PHYSICAL_ADDRESS addr;
+    UINTN bytes = (UINTN)stride * height * sizeof(uint32_t);
+
+    if (EFI_ERROR(BS->AllocatePages(AllocateAnyPages, EfiLoaderData, EFI_SIZE_TO_PAGES(bytes), &addr))) {
+        log_error(L"Failed to allocate a %d byte surface.\n", bytes);
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    // Bottom-up files start at their last row.
+    const uint8_t* first_row = (uint8_t*)bmp + offset;
+    INTN src_pitch = pitch;
+
+    if (raw_height > 0) {
+        first_row += pitch * (height - 1);
+        src_pitch = -src_pitch;
+    }
+
+    uint32_t rows_per_job = ROWS_PER_JOB;
+
+    while ((height + rows_per_job - 1) / rows_per_job > MAX_JOBS) {
+        rows_per_job *= 2;
+    }
+
+    UINTN njobs = 0;
+
+    for (uint32_t y = 0; y < height; y += rows_per_job, ++njobs) {
+        jobs[njobs].src = first_row + src_pitch * (INTN)y;
+        jobs[njobs].src_pitch = src_pitch;
+        jobs[njobs].dst = (uint32_t*)addr + (UINTN)y * stride;
+        jobs[njobs].dst_stride = stride;
+        jobs[njobs].width = width;
+        jobs[njobs].rows = height - y < rows_per_job ? height - y : rows_per_job;
+        jobs[njobs].bpp = bpp;
+        mp_jobs[njobs].fn = convert_band;
+        mp_jobs[njobs].arg = &jobs[njobs];
+    }
+
+    struct MpRun run = mp_run(mp_jobs, njobs);
+    convert_run.work += run.work;
+    convert_run.ncpus = run.ncpus > convert_run.ncpus ? run.ncpus : convert_run.ncpus;
+
+    surface->pixels = (uint32_t*)addr;
+    surface->width = width;
+    surface->height = height;
+    surface->stride = stride;
+    return EFI_SUCCESS;
+}
+
+
+/*
+ *  Converts every loaded BMP into fs.surfaces.
+ *
+ *  @stage: Timing stage the work is accounted to.
+ *
+ */
+
+void surface_convert_all(UINTN stage) {
+    uint64_t start = rdtsc();
+    uint64_t pixels = 0;
+
+    for (UINTN i = 0; i < MAX_BMP_IMPORTS; ++i) {
+        if (fs.bmps[i] == NULL) {
+            continue;
+        }
+
+        struct BMP* bmp = fs.bmps[i];
+
+        if (!EFI_ERROR(surface_from_bmp(bmp, bmp->header.file_size, &fs.surfaces[i]))) {
+            pixels += (uint64_t)fs.surfaces[i].width * fs.surfaces[i].height;
+        }
+    }
+
+    uint64_t us = timing_ticks_to_us(rdtsc() - start);
+
+    if (convert_run.ncpus > 1) {
+        timing_set_work(stage, convert_run.work, convert_run.ncpus);
+    }
+
+    log_info(L"Converted %ld BMP pixels in %ld us%a.\n", pixels, us, has_ssse3 ? " (SSSE3)" : "");
+}
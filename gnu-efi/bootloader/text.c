@@ -0,0 +1,328 @@
+/*
+ *  MIT License
+ *
+ *  Copyright (c) 2022 FacelessSociety, Ian Marco Moffett
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+
+#include <efi.h>
+#include <efilib.h>
+#include <common/text.h>
+#include <common/compositor.h>
+#include <common/glyph.h>
+#include <common/font.h>
+#include <common/log.h>
+#include <common/timing.h>
+
+// Tab stops every TAB_CELLS character cells from the clip's left edge.
+#define TAB_CELLS 8
+
+// Longest run of glyphs drawn row by row in one go.
+#define RUN_MAX 256
+
+extern struct FacelessServices fs;
+
+static inline BOOLEAN is_control(char c) {
+    return c == '\n' || c == '\r' || c == '\t';
+}
+
+
+// Stores the set pixels of 8 glyph columns, see glyph.c.
+static inline void store_set_pixels(uint32_t* dst, uint8_t bits, uint32_t fg, uint64_t pair) {
+    for (int p = 0; p < 8; p += 2, bits <<= 2) {
+        switch (bits & 0xC0) {
+            case 0xC0:
+                *(uint64_t*)(dst + p) = pair;
+                break;
+            case 0x80:
+                dst[p] = fg;
+                break;
+            case 0x40:
+                dst[p + 1] = fg;
+                break;
+        }
+    }
+}
+
+
+/*
+ *  Draws a run of glyphs on one text line, a pixel row at a time
+ *  across the whole run so stores stay sequential. Glyph rows go
+ *  8 columns per bitmap byte, the last byte may be partial.
+ *
+ */
+
+static void draw_run(const char* str, UINTN n, uint32_t fg, uint32_t bg, unsigned int x, unsigned int y, uint32_t* framebuffer) {
+    const uint8_t* bitmaps[RUN_MAX];
+    uint64_t ppsl = fs.framebuffer.ppsl;
+    uint32_t width = glyph_width();
+    uint32_t height = glyph_height();
+    uint32_t row_bytes = glyph_row_bytes();
+
+    // Masks off padding bits past the right edge in the last byte.
+    uint8_t tail_mask = width & 7 ? (uint8_t)(0xFF00 >> (width & 7)) : 0xFF;
+
+    for (UINTN i = 0; i < n; ++i) {
+        bitmaps[i] = glyph_bitmap(font_lookup((uint8_t)str[i]));
+    }
+
+    compositor_track(framebuffer, x, y, n * width, height);
+    uint32_t* line = framebuffer + y * ppsl + x;
+
+    if (bg == FRAMEBUF_TRANSPARENT) {
+        uint64_t pair = ((uint64_t)fg << 32) | fg;
+
+        for (uint32_t row = 0; row < height; ++row, line += ppsl) {
+            for (UINTN i = 0; i < n; ++i) {
+                const uint8_t* src = bitmaps[i] + row * row_bytes;
+                uint32_t* dst = line + i * width;
+
+                for (uint32_t b = 0; b < row_bytes; ++b, dst += 8) {
+                    uint8_t bits = b + 1 < row_bytes ? src[b] : src[b] & tail_mask;
+
+                    if (bits != 0) {
+                        store_set_pixels(dst, bits, fg, pair);
+                    }
+                }
+            }
+        }
+
+        return;
+    }
+
+    // Two-pixel stores, indexed by the left (bit 1) and right (bit 0) pixel.
+    uint64_t pairs[4] = {
+        ((uint64_t)bg << 32) | bg,
+        ((uint64_t)fg << 32) | bg,
+        ((uint64_t)bg << 32) | fg,
+        ((uint64_t)fg << 32) | fg
+    };
+
+    for (uint32_t row = 0; row < height; ++row, line += ppsl) {
+        uint32_t* dst = line;
+
+        for (UINTN i = 0; i < n; ++i) {
+            const uint8_t* src = bitmaps[i] + row * row_bytes;
+            uint32_t col = 0;
+
+            for (; col + 8 <= width; col += 8, ++src, dst += 8) {
+                uint8_t bits = *src;
+                uint64_t* d = (uint64_t*)dst;
+
+                d[0] = pairs[bits >> 6];
+                d[1] = pairs[(bits >> 4) & 3];
+                d[2] = pairs[(bits >> 2) & 3];
+                d[3] = pairs[bits & 3];
+            }
+
+            if (col < width) {
+                for (uint8_t bits = *src; col < width; ++col, bits <<= 1) {
+                    *dst++ = bits & 0x80 ? fg : bg;
+                }
+            }
+        }
+    }
+}
+
+
+/*
+ *  Draws text inside a clip rectangle, moving a pixel cursor.
+ *
+ *  @buf: Latin-1 text, bytes are code points for font_lookup().
+ *  @len: Bytes in @buf.
+ *  @fg: Text colour.
+ *  @bg: Background colour or FRAMEBUF_TRANSPARENT.
+ *  @clip: Rectangle to stay inside, NULL for the whole screen.
+ *  @x, @y: Cursor, top left of the next glyph. Updated.
+ *  @framebuffer: Framebuffer or backbuffer, ppsl pixels per row.
+ *
+ *  '\n' starts a new line, '\r' returns to the left edge and '\t'
+ *  moves to the next tab stop. Text wraps at the right edge, and
+ *  drawing stops at the first glyph that would cross the bottom.
+ *
+ *  Returns how many bytes were consumed.
+ *
+ */
+
+uint64_t framebuf_write_span(const char* buf, uint64_t len, uint32_t fg, uint32_t bg,
+        const struct FramebufClip* clip, unsigned int* x, unsigned int* y, uint32_t* framebuffer) {
+    uint32_t width = glyph_width();
+    uint32_t height = glyph_height();
+
+    if (height == 0) {
+        return 0;
+    }
+
+    uint32_t left = 0, top = 0, right = fs.framebuffer.width, bottom = fs.framebuffer.height;
+
+    if (clip != NULL) {
+        left = clip->x < right ? clip->x : right;
+        top = clip->y < bottom ? clip->y : bottom;
+        right = clip->width < right - left ? left + clip->width : right;
+        bottom = clip->height < bottom - top ? top + clip->height : bottom;
+    }
+
+    uint32_t cx = *x < left ? left : *x;
+    uint32_t cy = *y < top ? top : *y;
+    uint64_t i = 0;
+
+    while (i < len) {
+        char c = buf[i];
+
+        if (c == '\n' || c == '\r') {
+            cx = left;
+            cy += c == '\n' ? height : 0;
+            ++i;
+            continue;
+        }
+
+        if (c == '\t') {
+            uint32_t stop = TAB_CELLS * width;
+            cx = left + ((cx - left) / stop + 1) * stop;
+            ++i;
+            continue;
+        }
+
+        if (cx + width > right) {
+            cx = left;
+            cy += height;
+        }
+
+        if (cy + height > bottom || cx + width > right) {
+            break;
+        }
+
+        // Everything up to the next control byte or the right edge.
+        UINTN room = (right - cx) / width;
+        UINTN n = 0;
+
+        while (i + n < len && n < room && n < RUN_MAX && !is_control(buf[i + n])) {
+            ++n;
+        }
+
+        draw_run(buf + i, n, fg, bg, cx, cy, framebuffer);
+        cx += n * width;
+        i += n;
+    }
+
+    *x = cx;
+    *y = cy;
+    return i;
+}
+
+
+// framebuf_write_span() for a NUL terminated string.
+uint64_t framebuf_puts(const char* str, uint32_t fg, uint32_t bg,
+        const struct FramebufClip* clip, unsigned int* x, unsigned int* y, uint32_t* framebuffer) {
+    uint64_t len = 0;
+
+    while (str[len]) {
+        ++len;
+    }
+
+    return framebuf_write_span(str, len, fg, bg, clip, x, y, framebuffer);
+}
+
+
+#if FRAMEBUF_TEXT_BENCH
+
+#define BENCH_LINE "The quick brown fox jumps over the lazy dog, 0123456789 times.\n"
+#define BENCH_LINES 64
+
+
+// Logs characters per second of one way of drawing text.
+static void bench_report(const CHAR16* what, uint64_t chars, uint64_t ticks) {
+    uint64_t us = timing_ticks_to_us(ticks);
+    log_info(L"  %s: %ld chars in %ld us, %ld chars/s.\n", what, chars, us, us ? chars * 1000000 / us : 0);
+}
+
+
+/*
+ *  Draws the same screenful of text into the backbuffer through
+ *  framebuf_putch() one character at a time, the way a kernel
+ *  would, and through framebuf_write_span().
+ *
+ */
+
+void text_bench(void) {
+    static const char line[] = BENCH_LINE;
+    uint32_t width = glyph_width();
+    uint32_t height = glyph_height();
+    uint32_t* target = fs.framebuffer.backbuffer;
+
+    if (height == 0 || target == NULL) {
+        return;
+    }
+
+    uint64_t chars = 0;
+    uint64_t start = rdtsc();
+
+    // Per character: cursor maths, bounds checks and an indirect call each.
+    unsigned int x = 0, y = 0;
+
+    for (int l = 0; l < BENCH_LINES; ++l) {
+        for (const char* c = line; *c; ++c) {
+            if (*c == '\n' || x + width > fs.framebuffer.width) {
+                x = 0;
+                y = y + 2 * height > fs.framebuffer.height ? 0 : y + height;
+
+                if (*c == '\n') {
+                    continue;
+                }
+            }
+
+            fs.framebuf_putch(0xFFFFFF, *c, x, y, target);
+            x += width;
+            ++chars;
+        }
+    }
+
+    uint64_t putch_ticks = rdtsc() - start;
+
+    // Whole lines per call.
+    uint64_t span_ticks[2];
+    uint32_t bgs[2] = { FRAMEBUF_TRANSPARENT, 0x000000 };
+
+    for (int b = 0; b < 2; ++b) {
+        x = y = 0;
+        start = rdtsc();
+
+        for (int l = 0; l < BENCH_LINES; ++l) {
+            if (fs.framebuf_write_span(line, sizeof(line) - 1, 0xFFFFFF, bgs[b], NULL, &x, &y, target) < sizeof(line) - 1) {
+                x = y = 0;
+            }
+        }
+
+        span_ticks[b] = rdtsc() - start;
+    }
+
+    log_info(L"Text rendering, %d lines into the backbuffer:\n", BENCH_LINES);
+    bench_report(L"framebuf_putch", chars, putch_ticks);
+    bench_report(L"framebuf_write_span", chars, span_ticks[0]);
+    bench_report(L"framebuf_write_span (opaque)", chars, span_ticks[1]);
+}
+
+#else
+
+void text_bench(void) {
+}
+
+#endif
@@ -0,0 +1,143 @@
+/*
+ *  MIT License
+ *
+ *  Copyright (c) 2022 FacelessSociety, Ian Marco Moffett
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+
+#include <efi.h>
+#include <efilib.h>
+#include <common/services.h>
+#include <common/timing.h>
+
+// Stall length used to calibrate the TSC when CPUID can't tell us.
+#define TSC_CALIBRATION_US 1000
+
+extern struct FacelessServices fs;
+
+
+/*
+ *  Figures out the TSC frequency.
+ *
+ *  CPUID leaf 0x15 is used when it reports the crystal clock,
+ *  otherwise the TSC is measured across a short Stall().
+ *
+ */
+
+static uint64_t calibrate_tsc(void) {
+    uint32_t a, b, c, d;
+    cpuid(0, 0, &a, &b, &c, &d);
+
+    if (a >= 0x15) {
+        cpuid(0x15, 0, &a, &b, &c, &d);
+
+        if (a != 0 && b != 0 && c != 0) {
+            return ((uint64_t)c * b) / a;
+        }
+    }
+
+    uint64_t start = rdtsc();
+    BS->Stall(TSC_CALIBRATION_US);
+    uint64_t end = rdtsc();
+    return (end - start) * (1000000 / TSC_CALIBRATION_US);
+}
+
+
+/*
+ *  Sets up the boot timing table.
+ *
+ *  @tsc_entry: TSC value sampled at efi_main() entry.
+ *
+ */
+
+void timing_init(uint64_t tsc_entry) {
+    fs.timing.tsc_entry = tsc_entry;
+    fs.timing.nstages = 0;
+    fs.timing.tsc_freq = calibrate_tsc();
+}
+
+
+/*
+ *  Opens a new stage and returns its index.
+ *
+ *  @name: Stage name, truncated to BOOT_STAGE_NAME_LEN - 1.
+ *
+ */
+
+UINTN timing_begin(const char* name) {
+    if (fs.timing.nstages >= BOOT_TIMING_MAX_STAGES) {
+        return BOOT_TIMING_MAX_STAGES;
+    }
+
+    struct BootStage* stage = &fs.timing.stages[fs.timing.nstages];
+    UINTN i;
+
+    for (i = 0; i < BOOT_STAGE_NAME_LEN - 1 && name[i]; ++i) {
+        stage->name[i] = name[i];
+    }
+
+    stage->name[i] = '\0';
+    stage->end = 0;
+    stage->work = 0;
+    stage->ncpus = 1;
+    stage->start = rdtsc();
+    return fs.timing.nstages++;
+}
+
+
+// Closes a stage opened with timing_begin().
+void timing_end(UINTN stage) {
+    if (stage >= fs.timing.nstages) {
+        return;
+    }
+
+    fs.timing.stages[stage].end = rdtsc();
+}
+
+
+/*
+ *  Records how much work a stage did across processors. Only
+ *  for stages that ran on more than one CPU, serial ones keep 0.
+ *
+ *  @stage: Stage index from timing_begin().
+ *  @work: TSC ticks of work summed over every CPU.
+ *  @ncpus: CPUs that took part.
+ *
+ */
+
+void timing_set_work(UINTN stage, uint64_t work, UINT32 ncpus) {
+    if (stage >= fs.timing.nstages) {
+        return;
+    }
+
+    fs.timing.stages[stage].work = work;
+    fs.timing.stages[stage].ncpus = ncpus;
+}
+
+
+uint64_t timing_ticks_to_us(uint64_t ticks) {
+    if (fs.timing.tsc_freq == 0) {
+        return 0;
+    }
+
+    return ticks * 1000000 / fs.timing.tsc_freq;
+}
+
@@ -920,6 +920,12 @@ typedef struct _EFI_BOOT_SERVICES {
 #define SMBIOS3_TABLE_GUID    \
     { 0xf2fd1544, 0x9794, 0x4a2c, {0x99, 0x2e, 0xe5, 0xbb, 0xcf, 0x20, 0xe3, 0x94} }
 
+#define EFI_MEMORY_ATTRIBUTES_TABLE_GUID    \
+    { 0xdcfa911d, 0x26eb, 0x469f, {0xa2, 0x20, 0x38, 0xb7, 0xdc, 0x46, 0x12, 0x20} }
+
+#define LINUX_EFI_RANDOM_SEED_TABLE_GUID    \
+    { 0x1ce1e5bc, 0x7ceb, 0x42f2, {0x81, 0xe5, 0x8a, 0xad, 0xf1, 0x80, 0xf5, 0x7b} }
+
 #define SAL_SYSTEM_TABLE_GUID    \
     { 0xeb9d2d32, 0x2d88, 0x11d3, {0x9a, 0x16, 0x0, 0x90, 0x27, 0x3f, 0xc1, 0x4d} }
 
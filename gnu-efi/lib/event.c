@@ -148,7 +148,7 @@ WaitForEventWithTimeout (
                 return;
             }
         }
-    } while (Timeout > 0);
+    } while (Timeout > 0 && --Timeout > 0);
     CopyMem(Key, &TimeoutKey, sizeof(EFI_INPUT_KEY));
 }
 
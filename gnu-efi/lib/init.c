@@ -194,21 +194,12 @@ EFIDebugVariable (
 
 void *memset(void *s, int c, __SIZE_TYPE__ n)
 {
-    unsigned char *p = s;
-
-    while (n--)
-        *p++ = c;
-
+    RtSetMem(s, n, (UINT8)c);
     return s;
 }
 
 void *memcpy(void *dest, const void *src, __SIZE_TYPE__ n)
 {
-    const unsigned char *q = src;
-    unsigned char *p = dest;
-
-    while (n--)
-        *p++ = *q++;
-
+    RtCopyMem(dest, src, n);
     return dest;
 }
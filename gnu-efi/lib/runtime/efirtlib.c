@@ -20,6 +20,85 @@ Revision History
 #include "efilib.h"
 #include "efirtlib.h"
 
+//
+// The mem functions below move a UINTN at a time once the destination
+// is aligned, and use rep movsb/stosb on x86 when CPUID reports
+// Enhanced REP MOVSB/STOSB (ERMS) or Fast Short REP MOV (FSRM).
+//
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#define RT_MEM_X86
+#endif
+
+typedef UINTN __attribute__((__may_alias__, __aligned__(1))) RT_MEM_WORD;
+
+#define RT_MEM_WORD_MASK    (sizeof(UINTN) - 1)
+
+// Below this, word loops beat rep movsb/stosb without FSRM
+#define RT_MEM_REP_MIN      256
+
+#ifdef RT_MEM_X86
+
+#define RT_MEM_PROBED       0x01
+#define RT_MEM_ERMS         0x02
+#define RT_MEM_FSRM         0x04
+
+STATIC UINTN RtMemFeatures;
+
+STATIC
+UINTN
+RUNTIMEFUNCTION
+RtMemProbe (
+    VOID
+    )
+{
+    UINT32      Eax, Ebx, Ecx, Edx;
+    UINTN       Features;
+
+    if (RtMemFeatures) {
+        return RtMemFeatures;
+    }
+
+    Features = RT_MEM_PROBED;
+    __cpuid (0, Eax, Ebx, Ecx, Edx);
+
+    if (Eax >= 7) {
+        __cpuid_count (7, 0, Eax, Ebx, Ecx, Edx);
+
+        if (Ebx & (1 << 9)) {
+            Features |= RT_MEM_ERMS;
+        }
+
+        if (Edx & (1 << 4)) {
+            Features |= RT_MEM_FSRM;
+        }
+    }
+
+    RtMemFeatures = Features;
+    return Features;
+}
+
+#endif
+
+//
+// Word loads from Src are only unaligned where the CPU doesn't mind.
+//
+STATIC
+BOOLEAN
+RUNTIMEFUNCTION
+RtMemWordsOk (
+    IN CONST VOID   *Src
+    )
+{
+#ifdef RT_MEM_X86
+    (VOID) Src;
+    return TRUE;
+#else
+    return ((UINTN) Src & RT_MEM_WORD_MASK) == 0;
+#endif
+}
+
 #ifndef __GNUC__
 #pragma RUNTIME_CODE(RtZeroMem)
 #endif
@@ -30,12 +109,7 @@ RtZeroMem (
     IN UINTN     Size
     )
 {
-    INT8        *pt;
-
-    pt = Buffer;
-    while (Size--) {
-        *(pt++) = 0;
-    }
+    RtSetMem (Buffer, Size, 0);
 }
 
 #ifndef __GNUC__
@@ -49,9 +123,40 @@ RtSetMem (
     IN UINT8    Value    
     )
 {
-    INT8        *pt;
+    UINT8       *pt;
+    UINTN       Pattern;
 
     pt = Buffer;
+
+#ifdef RT_MEM_X86
+    if (Size >= RT_MEM_REP_MIN && (RtMemProbe () & RT_MEM_ERMS)) {
+        __asm__ __volatile__ ("rep stosb" : "+D" (pt), "+c" (Size) : "a" (Value) : "memory");
+        return;
+    }
+#endif
+
+    while (Size && ((UINTN) pt & RT_MEM_WORD_MASK)) {
+        *(pt++) = Value;
+        Size--;
+    }
+
+    Pattern = ((UINTN) -1 / 0xFF) * Value;
+
+    while (Size >= 4 * sizeof(UINTN)) {
+        ((RT_MEM_WORD *) pt)[0] = Pattern;
+        ((RT_MEM_WORD *) pt)[1] = Pattern;
+        ((RT_MEM_WORD *) pt)[2] = Pattern;
+        ((RT_MEM_WORD *) pt)[3] = Pattern;
+        pt += 4 * sizeof(UINTN);
+        Size -= 4 * sizeof(UINTN);
+    }
+
+    while (Size >= sizeof(UINTN)) {
+        *(RT_MEM_WORD *) pt = Pattern;
+        pt += sizeof(UINTN);
+        Size -= sizeof(UINTN);
+    }
+
     while (Size--) {
         *(pt++) = Value;
     }
@@ -71,6 +176,78 @@ RtCopyMem (
     CHAR8   *d;
     CONST CHAR8 *s = Src;
     d = Dest;
+
+    if (d == s || len == 0) {
+        return;
+    }
+
+    //
+    // Dest overlaps the end of Src, copy backwards so every byte is
+    // read before it's overwritten.
+    //
+    if (d > s && d < s + len) {
+        d += len;
+        s += len;
+
+        while (len && ((UINTN) d & RT_MEM_WORD_MASK)) {
+            *(--d) = *(--s);
+            len--;
+        }
+
+        if (RtMemWordsOk (s)) {
+            while (len >= sizeof(UINTN)) {
+                d -= sizeof(UINTN);
+                s -= sizeof(UINTN);
+                *(RT_MEM_WORD *) d = *(CONST RT_MEM_WORD *) s;
+                len -= sizeof(UINTN);
+            }
+        }
+
+        while (len--) {
+            *(--d) = *(--s);
+        }
+
+        return;
+    }
+
+#ifdef RT_MEM_X86
+    UINTN Features = RtMemProbe ();
+
+    // Forward rep movsb is byte-ordered, so Dest below Src is fine too
+    if ((Features & RT_MEM_FSRM) || (len >= RT_MEM_REP_MIN && (Features & RT_MEM_ERMS))) {
+        __asm__ __volatile__ ("rep movsb" : "+D" (d), "+S" (s), "+c" (len) : : "memory");
+        return;
+    }
+#endif
+
+    while (len && ((UINTN) d & RT_MEM_WORD_MASK)) {
+        *(d++) = *(s++);
+        len--;
+    }
+
+    if (RtMemWordsOk (s)) {
+        while (len >= 4 * sizeof(UINTN)) {
+            UINTN w0 = ((CONST RT_MEM_WORD *) s)[0];
+            ((RT_MEM_WORD *) d)[0] = w0;
+            UINTN w1 = ((CONST RT_MEM_WORD *) s)[1];
+            ((RT_MEM_WORD *) d)[1] = w1;
+            UINTN w2 = ((CONST RT_MEM_WORD *) s)[2];
+            ((RT_MEM_WORD *) d)[2] = w2;
+            UINTN w3 = ((CONST RT_MEM_WORD *) s)[3];
+            ((RT_MEM_WORD *) d)[3] = w3;
+            d += 4 * sizeof(UINTN);
+            s += 4 * sizeof(UINTN);
+            len -= 4 * sizeof(UINTN);
+        }
+
+        while (len >= sizeof(UINTN)) {
+            *(RT_MEM_WORD *) d = *(CONST RT_MEM_WORD *) s;
+            d += sizeof(UINTN);
+            s += sizeof(UINTN);
+            len -= sizeof(UINTN);
+        }
+    }
+
     while (len--) {
         *(d++) = *(s++);
     }
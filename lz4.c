@@ -0,0 +1,149 @@
+/*
+ *  MIT License
+ *
+ *  Copyright (c) 2022 FacelessSociety, Ian Marco Moffett
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+
+#include <common/lz4.h>
+
+// Smallest LZ4 match.
+#define LZ4_MIN_MATCH 4
+
+
+// Copies 8 bytes, may be unaligned.
+static inline void copy8(uint8_t* dst, const uint8_t* src) {
+    uint64_t tmp;
+    __builtin_memcpy(&tmp, src, 8);
+    __builtin_memcpy(dst, &tmp, 8);
+}
+
+
+// Reads an LZ4 length extension, returns FALSE if @src runs out.
+static inline BOOLEAN read_length(const uint8_t** ip, const uint8_t* iend, UINTN* len) {
+    uint8_t b;
+
+    do {
+        if (*ip >= iend) {
+            return FALSE;
+        }
+
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+
+    return TRUE;
+}
+
+
+/*
+ *  Decompresses a single LZ4 block.
+ *
+ *  @src: Compressed block.
+ *  @src_size: Size of @src.
+ *  @dst: Output buffer.
+ *  @dst_size: Size of @dst.
+ *
+ *  Returns the number of bytes written to @dst, or -1 if the
+ *  block is malformed or doesn't fit.
+ *
+ */
+
+INTN lz4_decompress(const uint8_t* src, UINTN src_size, uint8_t* dst, UINTN dst_size) {
+    const uint8_t* ip = src;
+    const uint8_t* iend = src + src_size;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + dst_size;
+
+    while (ip < iend) {
+        UINTN token = *ip++;
+
+        // Literals.
+        UINTN len = token >> 4;
+
+        if (len == 15 && !read_length(&ip, iend, &len)) {
+            return -1;
+        }
+
+        if (len > (UINTN)(iend - ip) || len > (UINTN)(oend - op)) {
+            return -1;
+        }
+
+        const uint8_t* lit_end = ip + len;
+
+        while ((UINTN)(lit_end - ip) >= 8) {
+            copy8(op, ip);
+            op += 8;
+            ip += 8;
+        }
+
+        while (ip < lit_end) {
+            *op++ = *ip++;
+        }
+
+        // The last sequence is literals only.
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+
+        UINTN offset = ip[0] | ((UINTN)ip[1] << 8);
+        ip += 2;
+
+        if (offset == 0 || offset > (UINTN)(op - dst)) {
+            return -1;
+        }
+
+        // Match.
+        len = token & 0xF;
+
+        if (len == 15 && !read_length(&ip, iend, &len)) {
+            return -1;
+        }
+
+        len += LZ4_MIN_MATCH;
+
+        if (len > (UINTN)(oend - op)) {
+            return -1;
+        }
+
+        const uint8_t* match = op - offset;
+        uint8_t* match_end = op + len;
+
+        // 8 byte chunks only when they can't overlap their own output.
+        if (offset >= 8) {
+            while ((UINTN)(match_end - op) >= 8) {
+                copy8(op, match);
+                op += 8;
+                match += 8;
+            }
+        }
+
+        while (op < match_end) {
+            *op++ = *match++;
+        }
+    }
+
+    return op - dst;
+}
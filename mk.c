@@ -0,0 +1,335 @@
+/*
+ *  MIT License
+ *
+ *  Copyright (c) 2022 FacelessSociety, Ian Marco Moffett
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+
+/*
+ *  mkfpack - builds a FacelessPack (.fpk) boot asset bundle.
+ *
+ *  usage: mkfpack -o <out.fpk> [-a <alignment>] [-c lz4|none] <file>...
+ *
+ *  -a sets the data alignment and -c the compression for every file
+ *  that follows it. Entries are stored in command line order under
+ *  their base name. A compressed entry that doesn't come out smaller
+ *  is stored raw.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fpack_format.h>
+
+#define DEFAULT_ALIGNMENT 16
+
+// LZ4 block format limits.
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MF_LIMIT 12
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_BITS 16
+
+
+struct InputFile {
+    const char* path;
+    uint8_t* data;
+    uint64_t size;
+    int compress;
+};
+
+
+static uint32_t crc32(const uint8_t* buf, uint64_t size) {
+    uint32_t crc = 0xFFFFFFFF;
+
+    while (size--) {
+        crc ^= *buf++;
+
+        for (int i = 0; i < 8; ++i) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+
+    return ~crc;
+}
+
+
+static uint32_t read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+
+static uint8_t* put_length(uint8_t* op, uint64_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+
+    *op++ = len;
+    return op;
+}
+
+
+// Emits one LZ4 sequence, a match length of 0 means literals only.
+static uint8_t* put_sequence(uint8_t* op, const uint8_t* lit, uint64_t nlit, uint64_t offset, uint64_t match_len) {
+    uint8_t* token = op++;
+    *token = (nlit >= 15 ? 15 : nlit) << 4;
+
+    if (nlit >= 15) {
+        op = put_length(op, nlit - 15);
+    }
+
+    memcpy(op, lit, nlit);
+    op += nlit;
+
+    if (match_len == 0) {
+        return op;
+    }
+
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+
+    uint64_t ml = match_len - LZ4_MIN_MATCH;
+    *token |= ml >= 15 ? 15 : ml;
+
+    if (ml >= 15) {
+        op = put_length(op, ml - 15);
+    }
+
+    return op;
+}
+
+
+/*
+ *  Greedy single block LZ4 compressor.
+ *
+ *  @dst must hold at least size + size / 255 + 16 bytes.
+ *  Returns the compressed size.
+ *
+ */
+
+static uint64_t lz4_compress(const uint8_t* src, uint64_t size, uint8_t* dst) {
+    static int64_t table[1 << LZ4_HASH_BITS];
+    uint8_t* op = dst;
+    uint64_t anchor = 0;
+    uint64_t ip = 0;
+
+    for (size_t i = 0; i < sizeof(table) / sizeof(table[0]); ++i) {
+        table[i] = -1;
+    }
+
+    while (size > LZ4_MF_LIMIT && ip < size - LZ4_MF_LIMIT) {
+        uint32_t seq = read32(src + ip);
+        uint32_t h = (seq * 2654435761U) >> (32 - LZ4_HASH_BITS);
+        int64_t ref = table[h];
+        table[h] = ip;
+
+        if (ref < 0 || ip - ref > LZ4_MAX_OFFSET || read32(src + ref) != seq) {
+            ++ip;
+            continue;
+        }
+
+        uint64_t len = LZ4_MIN_MATCH;
+
+        while (ip + len < size - LZ4_LAST_LITERALS && src[ref + len] == src[ip + len]) {
+            ++len;
+        }
+
+        op = put_sequence(op, src + anchor, ip - anchor, ip - ref, len);
+        ip += len;
+        anchor = ip;
+    }
+
+    op = put_sequence(op, src + anchor, size - anchor, 0, 0);
+    return op - dst;
+}
+
+
+static const char* base_name(const char* path) {
+    const char* slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+
+static int read_input(struct InputFile* in) {
+    FILE* fp = fopen(in->path, "rb");
+
+    if (fp == NULL) {
+        perror(in->path);
+        return -1;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    in->data = malloc(size ? size : 1);
+    in->size = size;
+
+    if (in->data == NULL || fread(in->data, 1, size, fp) != (size_t)size) {
+        fprintf(stderr, "%s: read failed\n", in->path);
+        fclose(fp);
+        return -1;
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+
+int mk_main(int argc, char** argv) {
+    const char* out_path = NULL;
+    uint32_t alignment = DEFAULT_ALIGNMENT;
+    int compress = 0;
+    struct InputFile inputs[FPACK_MAX_ENTRIES];
+    struct FPackEntry entries[FPACK_MAX_ENTRIES];
+    int ninputs = 0;
+
+    memset(entries, 0, sizeof(entries));
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            out_path = argv[++i];
+        } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            alignment = strtoul(argv[++i], NULL, 0);
+
+            if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+                fprintf(stderr, "alignment must be a power of two\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            ++i;
+
+            if (strcmp(argv[i], "lz4") == 0) {
+                compress = 1;
+            } else if (strcmp(argv[i], "none") == 0) {
+                compress = 0;
+            } else {
+                fprintf(stderr, "unknown compression: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (ninputs == FPACK_MAX_ENTRIES) {
+            fprintf(stderr, "too many files (max %d)\n", FPACK_MAX_ENTRIES);
+            return 1;
+        } else {
+            const char* name = base_name(argv[i]);
+
+            if (strlen(name) >= FPACK_NAME_LEN) {
+                fprintf(stderr, "%s: name longer than %d bytes\n", name, FPACK_NAME_LEN - 1);
+                return 1;
+            }
+
+            inputs[ninputs].path = argv[i];
+            inputs[ninputs].compress = compress;
+            strncpy(entries[ninputs].name, name, FPACK_NAME_LEN);
+            entries[ninputs].alignment = alignment;
+            ++ninputs;
+        }
+    }
+
+    if (out_path == NULL || ninputs == 0) {
+        fprintf(stderr, "usage: %s -o <out.fpk> [-a <alignment>] [-c lz4|none] <file>...\n", argv[0]);
+        return 1;
+    }
+
+    // Lay out the data after the index.
+    uint64_t offset = sizeof(struct FPackHeader) + ninputs * sizeof(struct FPackEntry);
+
+    for (int i = 0; i < ninputs; ++i) {
+        if (read_input(&inputs[i]) != 0) {
+            return 1;
+        }
+
+        entries[i].raw_size = inputs[i].size;
+
+        if (inputs[i].compress) {
+            uint8_t* packed = malloc(inputs[i].size + inputs[i].size / 255 + 16);
+
+            if (packed == NULL) {
+                fprintf(stderr, "%s: out of memory\n", inputs[i].path);
+                return 1;
+            }
+
+            uint64_t packed_size = lz4_compress(inputs[i].data, inputs[i].size, packed);
+
+            if (packed_size < inputs[i].size) {
+                free(inputs[i].data);
+                inputs[i].data = packed;
+                inputs[i].size = packed_size;
+                entries[i].flags |= FPACK_FLAG_LZ4;
+            } else {
+                free(packed);
+            }
+        }
+
+        uint64_t align = entries[i].alignment;
+        offset = (offset + align - 1) & ~(align - 1);
+
+        entries[i].name_hash = fpack_hash(entries[i].name);
+        entries[i].checksum = crc32(inputs[i].data, inputs[i].size);
+        entries[i].offset = offset;
+        entries[i].size = inputs[i].size;
+        offset += inputs[i].size;
+    }
+
+    struct FPackHeader header = {
+        .magic = FPACK_MAGIC,
+        .version = FPACK_VERSION,
+        .nentries = ninputs,
+        .index_crc = crc32((uint8_t*)entries, ninputs * sizeof(struct FPackEntry)),
+        .pack_size = offset
+    };
+
+    FILE* out = fopen(out_path, "wb");
+
+    if (out == NULL) {
+        perror(out_path);
+        return 1;
+    }
+
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(entries, sizeof(struct FPackEntry), ninputs, out);
+
+    for (int i = 0; i < ninputs; ++i) {
+        // Zero padding up to the entry's offset.
+        while ((uint64_t)ftell(out) < entries[i].offset) {
+            fputc(0, out);
+        }
+
+        fwrite(inputs[i].data, 1, inputs[i].size, out);
+        printf("%-32s %10llu -> %10llu bytes @ 0x%llx%s\n", entries[i].name,
+                (unsigned long long)entries[i].raw_size,
+                (unsigned long long)entries[i].size,
+                (unsigned long long)entries[i].offset,
+                (entries[i].flags & FPACK_FLAG_LZ4) ? " (lz4)" : "");
+        free(inputs[i].data);
+    }
+
+    if (fclose(out) != 0) {
+        perror(out_path);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,10 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "efi.h"
+INTN lz4_decompress(const uint8_t* src, UINTN src_size, uint8_t* dst, UINTN dst_size);
+uint64_t lz4c(const uint8_t* src, uint64_t size, uint8_t* dst);
+int rt(uint8_t* d, size_t n){ uint8_t* c=malloc(n+n/255+16); uint64_t cs=lz4c(d,n,c); uint8_t* o=malloc(n+1); INTN r=lz4_decompress(c,cs,o,n); int ok = r==(INTN)n && memcmp(o,d,n)==0; free(c); free(o); return ok?0:1;}
+int main(int argc,char**argv){ int bad=0;
+ for(int i=1;i<argc;i++){FILE*f=fopen(argv[i],"rb");fseek(f,0,2);long n=ftell(f);rewind(f);uint8_t*d=malloc(n);fread(d,1,n,f);bad|=rt(d,n);printf("%s %d\n",argv[i],rt(d,n));}
+ srand(1); for(int it=0;it<20000;it++){ size_t n=rand()%3000; uint8_t*d=malloc(n+1); int mode=rand()%3; for(size_t j=0;j<n;j++) d[j]= mode==0? rand(): mode==1? rand()%3 : (j%7); if(rt(d,n)){printf("fail n=%zu mode=%d\n",n,mode);bad=1;break;} free(d);} printf("bad=%d\n",bad);}
@@ -0,0 +1,2 @@
+#include "mk.c"
+uint64_t lz4c(const uint8_t* s, uint64_t n, uint8_t* d){return lz4_compress(s,n,d);}